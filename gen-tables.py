@@ -1,4 +1,74 @@
 import math
+import sys
+
+# Harmonics kept in each band-limited level, richest first.  A level is
+# used once a note is too high for the one before it.
+LEVEL_HARMONICS = [16, 8, 4, 2, 1]
+
+# Bytes of flash taken up by each instrument's levels, for the report.
+level_bytes = []
+resampler_bytes = []
+
+def print_samples(name, samples):
+    print("static const int8_t " + name + "[] = {")
+    cnt = 0
+    for val in samples:
+        if cnt == 0:
+            print("    ", end='')
+        print(str(int(val)) + ", ", end='')
+        cnt = cnt + 1
+        if cnt >= 8:
+            cnt = 0
+            print("")
+    if cnt != 0:
+        print("")
+    print("};")
+
+# Band-limited versions of a waveform for higher notes, made by adding up
+# its Fourier series.  `harmonic(n)` gives the sine and cosine amplitudes
+# of harmonic n.  Each level is long enough to hold its highest harmonic
+# four times over, and is scaled to fill the range.  A level is labelled
+# with the highest harmonic the wave actually has within its limit, and
+# one that adds nothing to the level after it is left out, so waves with
+# only odd harmonics don't store the same table twice.
+def gen_levels(name, harmonic):
+    total = 0
+    kept = []
+    for limit in LEVEL_HARMONICS:
+        present = [n for n in range(1, limit + 1) if harmonic(n) != (0, 0)]
+        if present and (not kept or present[-1] != kept[-1][1]):
+            kept.append((limit, present[-1]))
+    print("#define " + name.upper() + "_LEVEL_COUNT " + str(len(kept)))
+    for level, (limit, harmonics) in enumerate(kept):
+        entries = max(16, limit * 4)
+        wave = []
+        for x in range(entries):
+            val = 0.0
+            for n in range(1, harmonics + 1):
+                (sin_amp, cos_amp) = harmonic(n)
+                val += sin_amp * math.sin(2 * math.pi * n * x / entries)
+                val += cos_amp * math.cos(2 * math.pi * n * x / entries)
+            wave.append(val)
+        peak = max(abs(v) for v in wave)
+        samples = [max(-128, min(127, int(round(v * 127 / peak)))) for v in wave]
+        print_samples(name + "_level" + str(level) + "_samples", samples)
+        total += entries
+    print("static const struct ltc_wave_level " + name + "_levels[] = {")
+    for level, (limit, harmonics) in enumerate(kept):
+        print("    { " + name + "_level" + str(level) + "_samples, sizeof(" + name + "_level"
+              + str(level) + "_samples), " + str(harmonics) + " },")
+    print("};")
+    print("")
+    level_bytes.append((name, total, len(kept)))
+
+def sawtooth_harmonic(n):
+    return (2 / (math.pi * n), 0)
+
+def square_harmonic(n):
+    return (-4 / (math.pi * n) if n % 2 else 0, 0)
+
+def triangle_harmonic(n):
+    return (0, 8 / (math.pi * math.pi * n * n) if n % 2 else 0)
 
 def gen_sine(entries = 128):
     print("static const int8_t sine_table_samples[] = {")
@@ -38,7 +108,9 @@ def gen_sawtooth(entries = 2):
     print("static const struct ltc_instrument sawtooth_instrument = {")
     print("    .samples = sawtooth_table_samples,")
     print("    .length = SAWTOOTH_TABLE_SIZE,")
-    print("    .flags = 0,")
+    print("    .flags = INSTRUMENT_POLYBLEP,")
+    print("    .levels = sawtooth_levels,")
+    print("    .level_count = SAWTOOTH_LEVEL_COUNT,")
     print("};")
     print("")
 
@@ -70,6 +142,8 @@ def gen_triangle(entries = 32):
     print("    .samples = triangle_table_samples,")
     print("    .length = TRIANGLE_TABLE_SIZE,")
     print("    .flags = INSTRUMENT_CAN_INTERPOLATE,")
+    print("    .levels = triangle_levels,")
+    print("    .level_count = TRIANGLE_LEVEL_COUNT,")
     print("};")
     print("")
 
@@ -100,10 +174,86 @@ def gen_square(entries = 32):
     print("static const struct ltc_instrument square_instrument = {")
     print("    .samples = square_table_samples,")
     print("    .length = SQUARE_TABLE_SIZE,")
-    print("    .flags = 0,")
+    print("    .flags = INSTRUMENT_POLYBLEP,")
+    print("    .levels = square_levels,")
+    print("    .level_count = SQUARE_LEVEL_COUNT,")
+    print("};")
+    print("")
+
+# Noise is played from a two-entry table indexed by the low bit of a
+# Galois LFSR.  `taps` sets the register and so the period: 0xB400 is a
+# 16-bit maximal-length register (65535 steps) for hiss and snares, and 0x60
+# a 7-bit one (127 steps) whose short loop rings like metal.  The register
+# is clocked at the note's frequency times 2^`shift`.
+def gen_noise(name, taps, shift):
+    if name == "noise":
+        print("static const int8_t noise_table_samples[] = {")
+        print("    127, -127,")
+        print("};")
+        print("#define NOISE_TABLE_SIZE (sizeof(noise_table_samples))")
+    print("static const struct ltc_instrument " + name + "_instrument = {")
+    print("    .samples = noise_table_samples,")
+    print("    .length = NOISE_TABLE_SIZE,")
+    print("    .flags = INSTRUMENT_NOISE,")
+    print("    .noise_taps = " + hex(taps) + ",")
+    print("    .noise_shift = " + str(shift) + ",")
     print("};")
     print("")
 
+# Zeroth-order modified Bessel function, for the Kaiser window
+def bessel_i0(x):
+    total = term = 1.0
+    k = 1
+    while term > 1e-12 * total:
+        term *= (x / (2 * k)) ** 2
+        total += term
+        k += 1
+    return total
+
+# Polyphase filter for resampling the engine's output up to a higher rate:
+# a Kaiser-windowed sinc cut off at `cutoff` of the input's Nyquist
+# frequency, in RESAMPLE_PHASES + 1 rows of RESAMPLE_TAPS Q15 taps.  Row p
+# interpolates p / RESAMPLE_PHASES of the way past the middle of the
+# window, oldest sample first, and the last row lets the resampler
+# interpolate between rows without wrapping.  Each row sums to exactly
+# 1.0 so there's no DC ripple from row to row.
+def gen_resampler(taps = 16, phase_bits = 6, cutoff = 0.9, beta = 7.0):
+    phases = 1 << phase_bits
+    half = taps / 2
+    print("/* Polyphase resampler, cut off at " + str(cutoff) + " of the input's Nyquist */")
+    print("#define RESAMPLE_TAPS " + str(taps))
+    print("#define RESAMPLE_PHASE_BITS " + str(phase_bits))
+    print("#define RESAMPLE_PHASES (1 << RESAMPLE_PHASE_BITS)")
+    print("static const int16_t resample_taps[RESAMPLE_PHASES + 1][RESAMPLE_TAPS] = {")
+    for p in range(phases + 1):
+        row = []
+        for j in range(taps):
+            t = j - half + 1 - p / phases
+            if abs(t) >= half:
+                row.append(0.0)
+                continue
+            sinc = 1.0 if t == 0 else math.sin(math.pi * cutoff * t) / (math.pi * cutoff * t)
+            window = bessel_i0(beta * math.sqrt(1 - (t / half) ** 2)) / bessel_i0(beta)
+            row.append(cutoff * sinc * window)
+        scale = 32768 / sum(row)
+        taps_q15 = [int(round(v * scale)) for v in row]
+        peak = max(range(taps), key=lambda j: abs(taps_q15[j]))
+        taps_q15[peak] += 32768 - sum(taps_q15)
+        print("    { " + ", ".join(str(v) for v in taps_q15) + " },")
+    print("};")
+    print("")
+    resampler_bytes.append((phases + 1) * taps * 2)
+
+def report(out):
+    print("Band-limited levels (flash):", file=out)
+    for (name, samples, levels) in level_bytes:
+        print("  %-10s %4d bytes of samples in %d levels" % (name, samples, levels), file=out)
+    print("  %-10s %4d bytes of samples, plus %d bytes of level tables" % ("total",
+          sum(b for (_, b, _) in level_bytes), sum(l for (_, _, l) in level_bytes) * 8), file=out)
+    print("  (8 bytes per level on a 32-bit target, and each struct ltc_instrument", file=out)
+    print("  grows by 8 bytes for the level pointer and count)", file=out)
+    print("Resampler taps (flash): %d bytes" % sum(resampler_bytes), file=out)
+
 
 print("#ifndef WAVE_LUT_H")
 print("#define WAVE_LUT_H")
@@ -111,20 +261,48 @@ print("")
 print("/* Auto-generated file, do not edit */")
 print("/* File generated by gen-tables.py */")
 print("")
+print("/* A band-limited version of an instrument's table, for higher notes */")
+print("struct ltc_wave_level {")
+print("    const int8_t *samples;")
+print("    const uint16_t length;")
+print("    /* The highest harmonic in the table */")
+print("    const uint16_t harmonics;")
+print("};")
+print("")
 print("struct ltc_instrument {")
 print("    const int8_t *samples;")
 print("    const uint16_t length;")
 print("    const uint16_t flags;")
+print("    /* Band-limited levels, with the most harmonics first, if any */")
+print("    const struct ltc_wave_level *levels;")
+print("    const uint8_t level_count;")
+print("    /* For noise: the LFSR's Galois taps, and how far it's clocked above the note */")
+print("    const uint16_t noise_taps;")
+print("    const uint8_t noise_shift;")
 print("};")
 print("")
 print("/* Flags */")
 print("/* Indicates that interpolation on an instrument improves sound */")
 print("#define INSTRUMENT_CAN_INTERPOLATE (1 << 0)")
+print("/* Indicates that the waveform has hard edges, which may be band-limited */")
+print("#define INSTRUMENT_POLYBLEP (1 << 1)")
+print("/* Indicates that the table is indexed by an LFSR rather than the phase */")
+print("#define INSTRUMENT_NOISE (1 << 2)")
 print("")
 
 gen_sine(128)
+gen_levels("sawtooth", sawtooth_harmonic)
 gen_sawtooth(64)
+gen_levels("triangle", triangle_harmonic)
 gen_triangle(16)
+gen_levels("square", square_harmonic)
 gen_square(16)
+gen_noise("noise", 0xB400, 4)
+gen_noise("metallic", 0x60, 5)
+gen_resampler()
 
 print("#endif /* WAVE_LUT_H */")
+
+# Run with --report to see how much flash the levels cost.
+if "--report" in sys.argv[1:]:
+    report(sys.stderr)
@@ -1,17 +1,105 @@
 extern crate ghakuf;
 use ghakuf::messages::*;
 use ghakuf::reader::*;
+use std::env;
 use std::path;
 use std::fs;
 use std::io;
 use std::io::Write;
 
+// Song container layout; see song_container_header() in sound.c.
+const SONG_CONTAINER_VERSION: u16 = 1;
+const SONG_HEADER_BYTES: usize = 24;
+
+// Effects, as numbered in sound.c
+const SET_INSTRUMENT: u16 = 3;
+const SET_MIDDLE_C: u16 = 7;
+const CHANNEL_END: u16 = 10;
+
+// What the container plays the melody with: the square wave, at the
+// sample song's tempo and pitch.
+const INSTRUMENT_SQUARE: u8 = 3;
+const SPEED: u16 = 200;
+const MIDDLE_C: u8 = 71 - 12;
+
+fn nn(note: i32, duration: u16, pause: u16) -> u16 {
+    if note < -16 || note > 15 {
+        panic!("Note out of range: {}", note);
+    }
+    (((note + 16) as u16) & 0x1f) | ((duration << 10) & (0x1f << 10)) | ((pause << 5) & (0x1f << 5))
+}
+
+fn ne(effect: u16, arg: u8) -> u16 {
+    ((effect & 0x7f) << 8) | (arg as u16) | (1 << 15)
+}
+
+fn put_le16(buf: &mut [u8], value: u16) {
+    buf[0] = value as u8;
+    buf[1] = (value >> 8) as u8;
+}
+
+fn put_le32(buf: &mut [u8], value: u32) {
+    put_le16(buf, value as u16);
+    put_le16(&mut buf[2..], (value >> 16) as u16);
+}
+
+fn fnv1a(bytes: &[u8]) -> u32 {
+    let mut hash: u32 = 2166136261;
+    for byte in bytes {
+        hash = (hash ^ *byte as u32).wrapping_mul(16777619);
+    }
+    hash
+}
+
+// Write a song container that sound.c can play with `-s`.
+fn write_container(
+    filename: &str,
+    patterns: &[Vec<u16>],
+    channel_count: u8,
+    instruments: &[u8],
+    speed: u16,
+) -> io::Result<()> {
+    let addresses = SONG_HEADER_BYTES;
+    let tables = addresses + 4 * patterns.len() + ((instruments.len() + 1) & !1);
+    let mut data = vec![0u8; tables];
+
+    data[0..4].copy_from_slice(b"LTCS");
+    put_le16(&mut data[4..], SONG_CONTAINER_VERSION);
+    put_le16(&mut data[6..], SONG_HEADER_BYTES as u16);
+    data[8] = channel_count;
+    data[9] = patterns.len() as u8;
+    data[10] = instruments.len() as u8;
+    put_le16(&mut data[12..], speed);
+
+    let mut address = tables / 2;
+    for (i, pattern) in patterns.iter().enumerate() {
+        put_le32(&mut data[addresses + 4 * i..], address as u32);
+        address += pattern.len();
+    }
+    let start = addresses + 4 * patterns.len();
+    data[start..start + instruments.len()].copy_from_slice(instruments);
+    for pattern in patterns {
+        for op in pattern {
+            data.push(*op as u8);
+            data.push((*op >> 8) as u8);
+        }
+    }
+
+    let words = data.len() / 2;
+    put_le32(&mut data[16..], words as u32);
+    let checksum = fnv1a(&data[SONG_HEADER_BYTES..]);
+    put_le32(&mut data[20..], checksum);
+
+    fs::File::create(filename)?.write_all(&data)
+}
+
 struct HogeHandler {
     last_time: u32,
     last_note: i32,
     output: fs::File,
     lowest_note: u8,
     highest_note: u8,
+    notes: Vec<u16>,
 }
 
 impl HogeHandler {
@@ -23,6 +111,7 @@ impl HogeHandler {
             lowest_note: 0,
             highest_note: 0,
             output: output,
+            notes: Vec::new(),
         })
     }
 
@@ -35,6 +124,16 @@ impl HogeHandler {
             x => panic!("Unrecognized delta: {}", x),
         }
     }
+
+    pub fn delta_to_length(delta_time: u32) -> u16 {
+        match delta_time {
+            0 => 0,
+            12 => 2,
+            24 => 4,
+            48 => 8,
+            x => panic!("Unrecognized delta: {}", x),
+        }
+    }
 }
 
 impl Handler for HogeHandler {
@@ -60,6 +159,11 @@ impl Handler for HogeHandler {
                         Self::delta_to_note(self.last_time),
                         Self::delta_to_note((delta_time))
                     );
+                    self.notes.push(nn(
+                        self.last_note - 71,
+                        Self::delta_to_length(self.last_time),
+                        Self::delta_to_length(delta_time),
+                    ));
                 }
                 self.last_note = note as i32;
                 if note > self.highest_note {
@@ -88,6 +192,12 @@ impl Handler for HogeHandler {
 }
 
 fn main() {
+    let args: Vec<String> = env::args().collect();
+    let container = match args.len() {
+        1 => None,
+        3 if args[1] == "--container" => Some(args[2].clone()),
+        _ => panic!("Usage: {} [--container FILE]", args[0]),
+    };
     let path = path::Path::new("Nyancat.mid");
     let mut handler = HogeHandler::new("../song.h").expect("Couldn't create reader");
     {
@@ -97,4 +207,12 @@ fn main() {
     println!("Highest note: {}", &handler.highest_note);
     println!("Lowest note: {}", &handler.lowest_note);
     println!("Range: {}", handler.highest_note - handler.lowest_note);
+
+    if let Some(filename) = container {
+        let mut pattern = vec![ne(SET_INSTRUMENT, 0), ne(SET_MIDDLE_C, MIDDLE_C)];
+        pattern.extend_from_slice(&handler.notes);
+        pattern.push(ne(CHANNEL_END, 0));
+        write_container(&filename, &[pattern], 1, &[INSTRUMENT_SQUARE], SPEED)
+            .expect("Couldn't write container");
+    }
 }
@@ -1,10 +1,41 @@
+#if defined(DESKTOP) && defined(__linux__) && !defined(_GNU_SOURCE)
+// For pinning the render thread to a CPU
+#define _GNU_SOURCE
+#endif
 #include <stdint.h>
 #include <string.h>
 #include "wave-table.h"
 #include "note-table.h"
 
-//#define WRITE_TO_FILE
-#define VOICE_COUNT 2
+// Instruments SET_INSTRUMENT can pick from, per engine.  The built-in ones
+// take the first six slots, and engine_register_instrument() fills in the
+// rest.  Each slot is about 20 bytes of RAM on the device, so it only gets
+// two spare ones.
+#ifndef INSTRUMENT_SLOTS
+#ifdef DESKTOP
+#define INSTRUMENT_SLOTS 64
+#else
+#define INSTRUMENT_SLOTS 8
+#endif
+#endif
+
+// The most voices an engine can have.  The number actually mixed is chosen
+// when the engine is initialised, up to this limit.
+#ifndef MAX_VOICES
+#define MAX_VOICES 8
+#endif
+
+#if MAX_VOICES > 32
+#error "MAX_VOICES can be at most 32"
+#endif
+
+// The voice arrays are padded out to a whole number of SIMD groups.
+#define VOICE_LANES ((MAX_VOICES + 7) & ~7)
+
+// The most pattern channels a song can run at once.
+#ifndef MAX_CHANNELS
+#define MAX_CHANNELS 4
+#endif
 
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
@@ -22,6 +53,17 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <dlfcn.h>
+#endif
 #define panic(x) do {                         \
     fprintf(stderr, "PANIC: %s\n", x);        \
     exit(1);                                  \
@@ -94,7 +136,11 @@ enum ltc_pattern_effect {
     /// Repeat the current pattern this many times
     PATTERN_REPEAT_COUNT = 9,
 
-    FINAL_EFFECT = 10,
+    /// Stop this channel.  The song ends once every channel has stopped
+    /// and the last notes have died away.
+    CHANNEL_END = 10,
+
+    FINAL_EFFECT = 11,
 };
 
 enum adsr_phase {
@@ -114,21 +160,34 @@ static void print_phase(int i) {
     else if (i == PHASE_OFF) fprintf(stderr, "PHASE_OFF");
     else fprintf(stderr, "UNKNOWN (%d)", i);
 }
+#endif /* DEBUG_ADSR */
 
-#define ADSR_PHASE(v, p) do { \
-v->phase_timer = 0; \
-print_phase(v->adsr_phase); \
-fprintf(stderr, " -> "); \
-v->adsr_phase = p; \
-print_phase(v->adsr_phase); \
-fprintf(stderr, "\n"); \
-} while(0)
-#else /* !DEBUG_PHASE */
-#define ADSR_PHASE(v, p) do { \
-v->phase_timer = 0; \
-v->adsr_phase = p; \
-} while(0)
-#endif /* DEBUG_PHASE */
+// Move a voice's envelope into a new phase.  All of the envelope math
+// happens here, so processADSR() only has to step the level.
+#define ADSR_PHASE(e, v, p) adsr_enter_phase(e, v, p)
+
+// Envelope levels are fixed point, with ENVELOPE_ONE being 100%.  The level
+// is shifted down to ENVELOPE_GAIN_BITS before it's applied to a sample,
+// so the product of a sample and the gain always fits in 32 bits.
+#define ENVELOPE_BITS 24
+#define ENVELOPE_ONE (1L << ENVELOPE_BITS)
+#define ENVELOPE_GAIN_BITS 14
+// Levels are percentages, 0-100.  Past 100 the product overflows a 32-bit
+// long, so the SET_*_LEVEL effects cap their argument at ENVELOPE_MAX_LEVEL.
+#define ENVELOPE_MAX_LEVEL 100
+#define ENVELOPE_LEVEL(pct) ((int32_t)(((pct) * ENVELOPE_ONE) / 100))
+
+// Player gains are applied to the envelope once it has been shifted down,
+// with GAIN_ONE being 100%.
+#define GAIN_ONE (1L << ENVELOPE_GAIN_BITS)
+#define GAIN_LEVEL(pct) ((int32_t)(((pct) * GAIN_ONE) / 100))
+
+// Voices keep BUS_EXTRA_BITS more than the instruments' 8 bits through the
+// envelope, so quiet notes and slow fades hold their detail.  The mix bus
+// takes that to 16 bits, which is what render_block() puts out, and
+// bus_to_pwm() brings it down to the PWM's 8.
+#define BUS_EXTRA_BITS 8
+#define VOICE_SHIFT (ENVELOPE_GAIN_BITS - BUS_EXTRA_BITS)
 
 
 #define NN(note, duration, pause) (((((note)+16) & 0x1f)) \
@@ -145,9 +204,133 @@ v->adsr_phase = p; \
 // Note that some instruments don't support interpolation.
 #define INTERPOLATION_ENABLED 1
 
+// Band-limit instruments flagged INSTRUMENT_POLYBLEP, which takes the edge
+// off their aliasing at the cost of extra work per sample.  Voices playing
+// them are mixed by the scalar mixer.
+#ifndef POLYBLEP_ENABLED
+#ifdef DESKTOP
+#define POLYBLEP_ENABLED 1
+#else
+#define POLYBLEP_ENABLED 0
+#endif
+#endif
+
+// Play higher notes from the instruments' band-limited levels, picked once
+// per note.  This costs nothing per sample.
+#ifndef MIPMAPS_ENABLED
+#define MIPMAPS_ENABLED 1
+#endif
+
+// Specialise the voice kernels for each table length the instruments use,
+// so that scaling the phase by the length is a shift.  That's 16 more
+// kernels, and on the device, where a multiply is a single cycle anyway,
+// the flash is worth more.
+#ifndef SPECIALIZE_TABLE_LENGTHS
+#ifdef DESKTOP
+#define SPECIALIZE_TABLE_LENGTHS 1
+#else
+#define SPECIALIZE_TABLE_LENGTHS 0
+#endif
+#endif
+
+// Round the mix down to the PWM's 8 bits with dither, rather than just
+// dropping the low bits, and shape the dither's noise up towards the top of
+// the band where it's hardest to hear.
+#ifndef DITHER_ENABLED
+#define DITHER_ENABLED 1
+#endif
+
+// Bend a mix that would hit full scale round a knee, rather than flattening
+// it against the rails.
+#ifndef SOFT_CLIP_ENABLED
+#define SOFT_CLIP_ENABLED 1
+#endif
+
+// The most cycles the mix bus may spend on one sample on the device.  With
+// CYCLE_STATS, cycle_profile_print() says whether it kept to it.
+#ifndef BUS_CYCLE_BUDGET
+#define BUS_CYCLE_BUDGET 96
+#endif
+
+// Decode each song's patterns into struct ltc_op when it's selected, so the
+// sequencer can dispatch every op with a single table lookup.  This costs
+// DECODED_MAX_OPS * 4 bytes of RAM per song player, so it's off on the
+// device.
+#ifndef PREDECODE_PATTERNS
+#ifdef DESKTOP
+#define PREDECODE_PATTERNS 1
+#else
+#define PREDECODE_PATTERNS 0
+#endif
+#endif
+
+// Play songs whose patterns live outside memory, in SPI flash or a file,
+// read through a small cache.  This costs 4 * SONG_CACHE_WORDS bytes of
+// RAM per channel, so it's off on the device unless asked for.
+#ifndef SONG_STREAMING
+#ifdef DESKTOP
+#define SONG_STREAMING 1
+#else
+#define SONG_STREAMING 0
+#endif
+#endif
+
+// Words in each of a channel's two read-ahead windows.
+#ifndef SONG_CACHE_WORDS
+#ifdef DESKTOP
+#define SONG_CACHE_WORDS 64
+#else
+#define SONG_CACHE_WORDS 16
+#endif
+#endif
+
+// Songs that can play at once, each on its own player with its own gain, so
+// that one can be crossfaded into another.
+#ifndef SONG_PLAYERS
+#define SONG_PLAYERS 2
+#endif
+
+// While a player's gain is moving, voice gains are updated at least this
+// often, in samples.
+#ifndef GAIN_RUN
+#define GAIN_RUN 32
+#endif
+
+// Channels kept for sound effects started by trigger_sfx(), on top of the
+// songs' own.  0 leaves sound effects out.
+#ifndef SFX_CHANNELS
+#ifdef DESKTOP
+#define SFX_CHANNELS 2
+#else
+#define SFX_CHANNELS 1
+#endif
+#endif
+
+// Triggers that can wait to be picked up by the renderer.
+#ifndef SFX_QUEUE_DEPTH
+#define SFX_QUEUE_DEPTH 8
+#endif
+
+#if (SFX_QUEUE_DEPTH & (SFX_QUEUE_DEPTH - 1)) || (SFX_QUEUE_DEPTH > 128)
+#error "SFX_QUEUE_DEPTH must be a power of two no larger than 128"
+#endif
+
+// Streamed songs and sound effects are never pre-decoded, so they need the
+// sequencer that reads patterns as they are.
+#define RAW_PATTERNS (!PREDECODE_PATTERNS || SONG_STREAMING || SFX_CHANNELS)
+
+// Room for this many ops across all of a song's patterns when pre-decoding.
+#ifndef DECODED_MAX_OPS
+#define DECODED_MAX_OPS 4096
+#endif
+
+// A pattern that runs this long without a jump or CHANNEL_END is rejected.
+#define PATTERN_MAX_OPS 4096
+
 // Sets the maximum value of the phase accumulator, which is
 // used to skip through the sample array.
-#define PHASEACC_MAX 16384L
+#define PHASEACC_BITS 14
+#define PHASEACC_MAX (1L << PHASEACC_BITS)
 
 // The system is running off of a 32.768 kHz crystal going through
 // a 1464x FLL multiplier, giving a system frequency of
@@ -158,78 +341,323 @@ v->adsr_phase = p; \
 #define PWM_DELAY_LOOPS 24
 #define SAMPLE_RATE (187392/12)
 
-// The number of ticks that the sound system has gone through.
-// Overflows after about three days, at 14 kHz.
-volatile uint32_t global_tick_counter;
+// Depth of the sample FIFO between loop() and the PWM interrupt, in samples.
+// Must be a power of two.  A deeper FIFO rides out longer stalls elsewhere
+// in the firmware, at the cost of RAM and output latency.
+#ifndef SAMPLE_FIFO_DEPTH
+#define SAMPLE_FIFO_DEPTH 64
+#endif
+
+// loop() only refills the FIFO once at least this many slots are free, so
+// that rendering happens in bursts rather than one sample at a time.
+#ifndef SAMPLE_FIFO_BURST
+#define SAMPLE_FIFO_BURST (SAMPLE_FIFO_DEPTH / 2)
+#endif
+
+// The most samples render_block() mixes in one go, which sets the size of
+// a buffer on its stack.
+#ifndef MIX_RUN
+#ifdef DESKTOP
+#define MIX_RUN 256
+#else
+#define MIX_RUN 32
+#endif
+#endif
+
+#if (SAMPLE_FIFO_DEPTH & (SAMPLE_FIFO_DEPTH - 1)) || (SAMPLE_FIFO_DEPTH > 32768)
+#error "SAMPLE_FIFO_DEPTH must be a power of two no larger than 32768"
+#endif
+
+// Keep the compiler from moving buffer accesses across index updates.
+#define compiler_barrier() __asm__ volatile("" ::: "memory")
+
+// Read and publish an index shared between a producer and a consumer.  On
+// the device both sides run on the one M0+ core, one of them in an
+// interrupt, so the compiler barriers around these are all the ordering
+// needed.  On the desktop they can be threads on different cores of a
+// weakly ordered CPU, so an index is published with a release store, which
+// makes the entries written before it visible first, and read with an
+// acquire load.
+#ifdef DESKTOP
+#define index_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define index_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+#define index_load(p) (*(p))
+#define index_store(p, v) (*(p) = (v))
+#endif
+
+// For functions written once and built several ways, with constant
+// arguments picking the way.
+#if defined(__GNUC__) || defined(__clang__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+// Single-producer, single-consumer ring of PWM-ready samples.  loop() is
+// the only writer of `head`, and the PWM interrupt is the only writer of
+// `tail`, so no locking is needed.  Both indices run freely and are masked
+// on access, which keeps "full" and "empty" distinct.
+struct sample_fifo {
+    uint8_t samples[SAMPLE_FIFO_DEPTH];
+    volatile uint16_t head;
+    volatile uint16_t tail;
+
+    /// The sample most recently played, repeated if the FIFO runs dry.
+    uint8_t last;
+
+    /// Samples the interrupt has taken from the FIFO, ever.
+    volatile uint32_t played;
+
+    /// Number of times the interrupt found the FIFO empty.
+    volatile uint32_t underruns;
+
+    /// The most samples the FIFO has ever been short of full when the
+    /// interrupt ran, i.e. the worst-case lag of loop().  Keep
+    /// SAMPLE_FIFO_DEPTH comfortably above this.
+    volatile uint16_t high_water;
+};
+
+static inline uint16_t sample_fifo_fill(const struct sample_fifo *fifo)
+{
+    return (uint16_t)(index_load(&fifo->head) - index_load(&fifo->tail));
+}
+
+// Consumer side, called from the PWM interrupt.
+static inline uint8_t sample_fifo_pop(struct sample_fifo *fifo)
+{
+    uint16_t tail = fifo->tail;
+    uint16_t fill = (uint16_t)(index_load(&fifo->head) - tail);
+
+    if (SAMPLE_FIFO_DEPTH - fill > fifo->high_water)
+        fifo->high_water = SAMPLE_FIFO_DEPTH - fill;
 
-// The next sample to be played, nominally between -128 and 127
-static int32_t next_sample;
+    if (!fill) {
+        fifo->underruns = fifo->underruns + 1;
+        return fifo->last;
+    }
+
+    fifo->last = fifo->samples[tail & (SAMPLE_FIFO_DEPTH - 1)];
+    compiler_barrier();
+    index_store(&fifo->tail, tail + 1);
+    fifo->played = fifo->played + 1;
+    return fifo->last;
+}
 
-// Nonzero if a sample has been queued, zero if the sample buffer is empty.
-static volatile uint8_t sample_queued = 0;
+static inline void sample_fifo_reset_stats(struct sample_fifo *fifo)
+{
+    fifo->underruns = 0;
+    fifo->high_water = 0;
+}
 
+// The instruments every engine starts with, in these slots.
 static const struct ltc_instrument *instruments[] = {
     &triangle_instrument,
     &sawtooth_instrument,
     &sine_instrument,
     &square_instrument,
+    &noise_instrument,
+    &metallic_instrument,
 };
 
-// An ltc voice
-struct ltc_voice
-{
-    /// The current note's frequency.
-    uint32_t frequency;
+// An instrument in an engine's registry.  It's checked when it's
+// registered, and what note_on() would otherwise work out from it for
+// every note is kept here, so nothing about it is checked while playing.
+struct ltc_instrument_slot {
+    const int8_t *samples;          // NULL if the slot is empty
+    const struct ltc_wave_level *levels;
+    uint16_t length;
+    uint16_t flags;
 
-    /// A pointer to the currently-selected instrument.
-    const struct ltc_instrument *instrument;
+    // PHASEACC_MAX - 1 if the table can be interpolated, or 0
+    uint16_t distance_mask;
+
+    uint8_t level_count;
+
+    // The voice_kernels row for `length`
+    uint8_t kernel_length;
 
+    // The most harmonics the table itself can hold: half its length
+    uint16_t harmonics;
+
+    // For INSTRUMENT_NOISE, the LFSR's taps and clock shift
+    uint16_t noise_taps;
+    uint8_t noise_shift;
+};
+
+// Marks a channel that isn't playing a voice, or a voice no channel owns.
+#define NO_VOICE 0xff
+#define NO_CHANNEL 0xff
+
+// Envelope settings.  A channel's patterns set these, and each voice takes
+// a copy when it starts a note so that later changes don't affect notes
+// that are still ringing out.
+struct ltc_adsr
+{
     /// How long the Attack phase is
     uint32_t attack_time;
 
+    /// How long the Decay time is
+    uint32_t decay_time;
+
+    /// How long the Release phase is (i.e. after the note has ended)
+    uint32_t release_time;
+
     /// How strong the Attack phase starts
     uint8_t attack_level;
 
     /// How strong the Decay phase starts (and the Attack phase ends)
     uint8_t decay_level;
 
-    /// How long the Decay time is
-    uint32_t decay_time;
-
     /// How strong the Sustain phase is (after the Decay phase ends)
     uint8_t sustain_level;
+};
 
-    /// How long the Release phase is (i.e. after the note has ended)
-    uint32_t release_time;
+struct ltc_sound_engine;
+
+// Renders one sample of one voice.  See voice_pick_kernel().
+typedef int32_t (*voice_kernel_t)(struct ltc_sound_engine *engine, uint8_t voice_num);
+
+// An ltc voice, which plays a single note.  Voices come from a pool in the
+// engine and are handed out to channels as notes start.  The state that
+// changes every sample lives in struct ltc_voice_lanes instead.
+struct ltc_voice
+{
+    /// The current note's frequency.
+    uint32_t frequency;
+
+    /// A pointer to the currently-selected instrument.
+    const struct ltc_instrument_slot *instrument;
+
+    /// The voice_kernels row for the table the note plays from.
+    uint8_t kernel_length;
+
+    /// The envelope settings this note was started with.
+    struct ltc_adsr adsr;
+
+    /// Increases with every note started, so older voices can be found.
+    uint32_t serial;
+
+    /// The channel that started this voice, or NO_CHANNEL.
+    uint8_t owner;
+
+    /// For band-limited voices, the phases where the table jumps and by
+    /// how much, or a height of 0 if there's no such edge.
+    uint16_t edge_phase[2];
+    int16_t edge_height[2];
+
+    /// For band-limited voices, (1 << 28) / phase_increment
+    uint32_t phase_reciprocal;
+
+    /// 0: off
+    /// 1: attack
+    /// 2: decay
+    /// 3: sustain
+    /// 4: release
+    uint8_t adsr_phase;
+
+    /// Renders the voice's next sample, for the scalar mixer
+    voice_kernel_t kernel;
+};
 
+// The per-sample state of every voice, stored as one array per field so the
+// mixer can work on several voices at once.  Entry N belongs to voice N.
+// Voices that are off point at a silent table and have a level of zero, so
+// any of them can be run through the mixer safely.
+struct ltc_voice_lanes
+{
     // Keeps track of the phase in the instrument at the
     // given frequency.
-    uint32_t phase_accumulator;
+    uint32_t phase_accumulator[VOICE_LANES];
+
+    /// How far the phase accumulator advances each sample.  This is
+    /// derived from the frequency once per note, in note_on().
+    uint32_t phase_increment[VOICE_LANES];
+
+    /// The current envelope level, where ENVELOPE_ONE is 100%
+    int32_t envelope_level[VOICE_LANES];
+
+    /// How much envelope_level changes every sample in this phase
+    int32_t envelope_step[VOICE_LANES];
+
+    /// The gain of the player this voice belongs to, where GAIN_ONE is 100%
+    int32_t gain[VOICE_LANES];
+
+    /// Samples left until the next phase, or 0 if this phase doesn't end
+    uint32_t envelope_remaining[VOICE_LANES];
+
+    /// The instrument's table and its length
+    const int8_t *samples[VOICE_LANES];
+    uint32_t length[VOICE_LANES];
+
+    /// PHASEACC_MAX - 1 if the instrument is interpolated, otherwise 0
+    uint32_t distance_mask[VOICE_LANES];
 
-    /// How far into the current phase are we
-    uint32_t phase_timer;
+    /// For noise, the LFSR and its Galois taps.  Tonal voices have no taps.
+    uint32_t noise_state[VOICE_LANES];
+    uint32_t noise_taps[VOICE_LANES];
+};
+
+// An ltc channel, which steps through one stream of patterns and starts a
+// voice for each note.
+struct ltc_channel
+{
+    // The song this channel's patterns come from: its player's, or a
+    // sound effect's
+    const struct ltc_song *song;
+
+    // The player whose speed this channel runs at.  Sound effects use
+    // player 0's.
+    uint8_t player;
 
     // A pointer to the currently-operating pattern
     const uint16_t *pattern;
+#if PREDECODE_PATTERNS
+    // The same pattern, decoded
+    const struct ltc_op *ops;
+#endif
+#if SONG_STREAMING
+    // For streamed songs, where the pattern starts in the song's source
+    uint32_t pattern_address;
+#endif
     uint16_t pattern_num;
     uint16_t pattern_offset;
     uint8_t pattern_repeat_count;
 
-    /// The number of ticks left until we issue a Release.
+    /// The number of samples left until we issue a Release.
     uint32_t note_duration;
 
     /// After the note, there is a period of time to wait for the next note.
     uint32_t rest_duration;
 
+    /// The fraction of a sample, in 1/65536ths, that the last duration fell
+    /// short of its ticks by, which goes on the next one.
+    uint16_t tick_carry;
+
+    /// A pointer to the currently-selected instrument.
+    const struct ltc_instrument_slot *instrument;
+
+    /// Envelope settings for the next note.
+    struct ltc_adsr adsr;
+
     /// All notes are relative to this note.
     uint8_t middle_c;
 
-    /// 0: off
-    /// 1: attack
-    /// 2: decay
-    /// 3: sustain
-    /// 4: release
-    uint8_t adsr_phase;
+    /// The voice playing this channel's most recent note, or NO_VOICE.
+    uint8_t voice;
+};
+
+// How to pick a voice to cut off when every voice in the pool is busy.
+enum voice_steal_policy {
+    /// Take the voice that started longest ago.
+    VOICE_STEAL_OLDEST,
+
+    /// Take the voice with the lowest envelope level.
+    VOICE_STEAL_QUIETEST,
+
+    /// Take the oldest voice that's already releasing, or the oldest voice
+    /// if none are.
+    VOICE_STEAL_RELEASED_FIRST,
 };
 
 static const uint16_t voice0_setup[] = {
@@ -269,513 +697,5379 @@ static const uint16_t *sample_song_patterns[] = {
     SONG_PATTERNS
 };
 
+// Somewhere pattern words can be read from, such as SPI flash or a file.
+// Addresses and counts are in 16-bit words.
+struct ltc_song_source {
+    /// Copy `count` words from `address` into `words`.  Returns the number
+    /// of words read, which is short only at the end of the source.
+    uint32_t (*read)(void *context, uint32_t address, uint16_t *words, uint32_t count);
+    void *context;
+};
+
 struct ltc_song {
     const uint16_t **patterns;
-    const uint8_t pattern_count;
+    uint8_t pattern_count;
+
+    // The first `channel_count` patterns are where each channel starts.
+    uint8_t channel_count;
+
+    // If set, `patterns` is unused and pattern N starts at
+    // words[pattern_addresses[N]], as in a song container.  No pattern may
+    // run past `word_count`.
+    const uint16_t *words;
+    const uint32_t *pattern_addresses;
+    uint32_t word_count;
+
+    // If set, SET_INSTRUMENT picks instruments[arg] rather than arg.
+    const uint8_t *instruments;
+    uint8_t instrument_count;
+
+    // Loops per tick to start at, or 0 to leave it to the patterns.
+    uint16_t speed;
+
+#if SONG_STREAMING
+    // If set, patterns are read from `source` instead, at the same
+    // addresses as `words` would have them.
+    const struct ltc_song_source *source;
+#endif
+};
+
+// A pattern op after decoding.  Each one matches the op at the same offset
+// in the original pattern, so pattern_offset means the same in both.
+struct ltc_op {
+    /// Index into op_handlers
+    uint8_t handler;
+
+    /// The effect's argument.  For notes, the offset from middle C.
+    uint8_t arg;
+
+    /// For notes, the note length in ticks in the low byte and the rest
+    /// after it in the high byte.  For the time ops, the time in
+    /// milliseconds, which the setters convert at the engine's rate.
+    uint16_t value;
+};
+
+// Where setSong() found a problem with a song.
+struct ltc_song_error {
+    const char *message;
+    uint8_t pattern;
+    uint16_t offset;
 };
 
 static const struct ltc_song sample_song = {
     .patterns = sample_song_patterns,
     .pattern_count = ARRAY_SIZE(sample_song_patterns),
+    .channel_count = 2,
 };
 
-struct ltc_sound_engine {
-    struct ltc_voice voices[VOICE_COUNT];
+#ifdef CYCLE_STATS
+// Build with -DCYCLE_STATS to time every output sample and every
+// get_sample() call.  The results live in engine->cycles, so they can be
+// read at runtime from a debugger or from the firmware itself.
+//
+// On the device the time comes from SysTick, counting CPU clocks.  A sample
+// that takes longer than one SysTick period will be under-counted.  On the
+// desktop it comes from the TSC on x86 and is in nanoseconds elsewhere.
+//
+// Instrumented desktop builds use the scalar mixer, since the SIMD mixers
+// don't go through get_sample().
 
-    // Global counter
-    uint32_t tick_counter;
+// The histogram is linear, 1 << CYCLE_BUCKET_SHIFT cycles per bucket, with
+// everything past the end landing in the last bucket.  The default covers
+// 4096 cycles, a little more than the device has per sample.
+#define CYCLE_BUCKETS 32
+#ifndef CYCLE_BUCKET_SHIFT
+#define CYCLE_BUCKET_SHIFT 7
+#endif
 
-    // Number of loops-per-tick
-    uint32_t loops_per_tick;
+// What the engine was doing during a timed stretch.
+struct cycle_context {
+    /// The last pattern op decoded
+    uint16_t op;
 
-    // Currently-selected song
-    const struct ltc_song *song;
+    /// How many pattern ops were decoded
+    uint8_t ops;
+
+    /// How many envelope phase changes happened
+    uint8_t transitions;
+
+    /// For get_sample(), the voice's envelope phase going in
+    uint8_t phase;
 };
 
-static struct ltc_sound_engine engine;
+struct cycle_stats {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint32_t histogram[CYCLE_BUCKETS];
 
-static void patternDelay(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg)
-{
-    engine->voices[channel].rest_duration = arg * engine->loops_per_tick;
-}
+    /// What was happening during the slowest one
+    struct cycle_context worst;
+};
 
-static void patternJumpAbs(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg)
-{
-    if (arg >= engine->song->pattern_count) {
-        panic("attempt to abs jump to nonexistent pattern");
-    }
-    engine->voices[channel].pattern = engine->song->patterns[arg];
-    engine->voices[channel].pattern_num = arg;
-    engine->voices[channel].pattern_offset = 0;
-    engine->voices[channel].pattern_repeat_count = 0;
-}
+struct cycle_profile {
+    /// Everything done for one output sample: sequencer and mixing
+    struct cycle_stats sample;
 
-static void patternJumpRel(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg)
-{
-    int8_t target_num = (int8_t)engine->voices[channel].pattern_num + (int8_t)arg;
-    if (target_num >= engine->song->pattern_count) {
-        panic("attempt to rel jump to nonexistent pattern");
-    }
-    if (target_num < 0) {
-        panic("attempt to jump to nonexistent pattern < 0");
-    }
-    engine->voices[channel].pattern = engine->song->patterns[target_num];
-    engine->voices[channel].pattern_num = target_num;
-    engine->voices[channel].pattern_offset = 0;
-    engine->voices[channel].pattern_repeat_count = 0;
-}
+    /// One voice's get_sample() call
+    struct cycle_stats voice;
 
-static void setInstrument(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg)
-{
-    if (arg >= ARRAY_SIZE(instruments))
-        panic("instrument is out of range");
-    engine->voices[channel].instrument = instruments[arg];
-}
+    /// The mix bus's share of each sample, and bringing it down to 8 bits
+    struct cycle_stats bus;
+    struct cycle_stats dither;
 
-static void setAttackTime(struct ltc_sound_engine *engine, uint8_t channel, uint16_t arg)
+    /// What the current sample has done so far
+    struct cycle_context context;
+};
+
+#ifdef ARDUINO_APP
+#define SYST_CSR (*(volatile uint32_t *)0xE000E010)
+#define SYST_RVR (*(volatile uint32_t *)0xE000E014)
+#define SYST_CVR (*(volatile uint32_t *)0xE000E018)
+
+static inline uint32_t cycle_now(void)
 {
-    engine->voices[channel].attack_time = (arg * SAMPLE_RATE) / 1000;
+    return SYST_CVR;
 }
 
-static void setAttackLevel(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg)
+// SysTick counts down and wraps at its reload value.
+static inline uint32_t cycles_since(uint32_t start)
 {
-    engine->voices[channel].attack_level = arg;
+    uint32_t now = SYST_CVR;
+
+    if (now <= start)
+        return start - now;
+    return start + SYST_RVR + 1 - now;
 }
+#elif defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
 
-static void setDecayLevel(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg)
+static inline uint32_t cycle_now(void)
 {
-    engine->voices[channel].decay_level = arg;
+    return (uint32_t)__rdtsc();
 }
 
-static void setDecayTime(struct ltc_sound_engine *engine, uint8_t channel, uint16_t arg)
+static inline uint32_t cycles_since(uint32_t start)
 {
-    engine->voices[channel].decay_time = (arg * SAMPLE_RATE) / 1000;
+    return (uint32_t)__rdtsc() - start;
 }
-
-static void setSustainLevel(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg)
+#else
+static inline uint32_t cycle_now(void)
 {
-    engine->voices[channel].sustain_level = arg;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000u + now.tv_nsec;
 }
 
-static void setReleaseTime(struct ltc_sound_engine *engine, uint8_t channel, uint16_t arg)
+static inline uint32_t cycles_since(uint32_t start)
 {
-    engine->voices[channel].release_time = (arg * SAMPLE_RATE) / 1000;
+    return cycle_now() - start;
 }
+#endif
 
-static void setGlobalSpeed(struct ltc_sound_engine *engine, uint8_t channel, uint16_t arg)
+// Record `count` samples that took `cycles` between them.  Runs of samples
+// are timed together, so each is counted at the run's average.
+static void cycle_stats_add(struct cycle_stats *stats, uint32_t cycles, uint32_t count,
+                            const struct cycle_context *context)
 {
-    (void)channel;
-    engine->loops_per_tick = arg;
-}
+    uint32_t bucket;
 
-static void setMiddleC(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg) {
-    engine->voices[channel].middle_c = arg;
+    stats->total += cycles;
+    cycles /= count;
+    bucket = cycles >> CYCLE_BUCKET_SHIFT;
+    if (bucket >= CYCLE_BUCKETS)
+        bucket = CYCLE_BUCKETS - 1;
+    stats->histogram[bucket] += count;
+
+    if (!stats->count || (cycles < stats->min))
+        stats->min = cycles;
+    if (cycles > stats->max) {
+        stats->max = cycles;
+        stats->worst = *context;
+    }
+    stats->count += count;
 }
 
-static void patternRepeatCount(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg) {
-    struct ltc_voice *voice = &engine->voices[channel];
-    int new_count = voice->pattern_repeat_count - 1;
+#define CYCLE_NOTE_OP(e, o) do {                \
+    (e)->cycles.context.op = (o);               \
+    (e)->cycles.context.ops++;                  \
+} while (0)
+#define CYCLE_NOTE_TRANSITION(e) do {           \
+    (e)->cycles.context.transitions++;          \
+} while (0)
+#else
+#define CYCLE_NOTE_OP(e, o)
+#define CYCLE_NOTE_TRANSITION(e)
+#endif /* CYCLE_STATS */
 
-    // If pattern_repeat_count is nonzero, then we're in the middle of repeating.
-    switch (voice->pattern_repeat_count) {
-    // If it's 1, then it's a NOP, since we've already processed it
-    // during this iteration of a pattern.  Must jump to a new pattern
-    // first.
-    case 1:
-        break;
-    case 0:
-        new_count = arg - 1;
-        /* Fall through */
+#if SONG_STREAMING
+// A run of words copied from a song's source.
+struct ltc_song_window {
+    uint32_t start;
+    uint16_t count;
+    uint16_t words[SONG_CACHE_WORDS];
+};
+
+// Each channel reads ahead of itself in one window, and keeps the start of
+// the pattern it'll jump to next in the other.  They swap on the jump.
+struct ltc_song_cache {
+    struct ltc_song_window window[2];
+    uint8_t active;
+};
+#endif
+
+// Player N's channels are channels[N * MAX_CHANNELS] on, and the sound
+// effect channels come after all of them.
+#define SFX_FIRST_CHANNEL (SONG_PLAYERS * MAX_CHANNELS)
+#define CHANNEL_SLOTS (SFX_FIRST_CHANNEL + SFX_CHANNELS)
+
+// One song playing, with its own channels, speed, gain and voices.
+struct ltc_player {
+    const struct ltc_song *song;
+    uint8_t channel_count;
+
+    // Samples per tick, in 1/65536ths of a sample, so tempos that aren't a
+    // whole number of samples keep time
+    uint32_t tick_length;
+
+    // Bit N is set if the player's notes may use voice N
+    uint32_t voices;
+
+    // The gain set by the player's fades, and that after ducking, which is
+    // what its voices play at.  GAIN_ONE is 100%.
+    int32_t gain;
+    int32_t mixed_gain;
+
+    // Nonzero if the player is turned down while sound effects play
+    uint8_t ducked;
+
+    // A fade from `fade_from` to `fade_to` over the `fade_length` samples
+    // starting at `fade_start`, if `fading`.  If `fade_stop` is set the
+    // song stops once it's done.
+    uint8_t fading;
+    uint8_t fade_stop;
+    int32_t fade_from;
+    int32_t fade_to;
+    uint32_t fade_start;
+    uint32_t fade_length;
+
+    // If set, the song starts on sample `start`
+    uint8_t starting;
+    uint32_t start;
+
+#if PREDECODE_PATTERNS
+    // The song's patterns, decoded back to back, if `decoded`
+    struct ltc_op ops[DECODED_MAX_OPS];
+    uint16_t pattern_start[256];
+    uint8_t decoded;
+#endif
+};
+
+#if SFX_CHANNELS
+// A request from trigger_sfx() to start a sound effect.
+struct ltc_sfx_trigger {
+    const struct ltc_song *sfx;
+
+    /// The sample to start on, unless `now` is set
+    uint32_t start;
+
+    /// The sample that was playing when it was triggered
+    uint32_t triggered;
+
+    uint8_t priority;
+    uint8_t now;
+};
+
+// Single-producer, single-consumer ring of triggers, in the same style as
+// sample_fifo: trigger_sfx() is the only writer of `head`, and
+// render_block() the only writer of `tail`.
+struct ltc_sfx_queue {
+    struct ltc_sfx_trigger triggers[SFX_QUEUE_DEPTH];
+    volatile uint8_t head;
+    volatile uint8_t tail;
+
+    /// Triggers turned away because the queue was full
+    volatile uint32_t dropped;
+};
+
+struct ltc_sfx_stats {
+    /// Sound effects started, and turned away because every sound effect
+    /// channel was busy with one of a higher priority
+    uint32_t started;
+    uint32_t refused;
+
+    /// Sound effects asked to start on a sample that had already been
+    /// rendered by the time they were picked up.  These start at once.
+    uint32_t late;
+
+    /// Samples from each trigger to the sound effect's first sample
+    /// reaching the output.  For effects started at once this is the
+    /// latency; for ones started on a later sample it includes the wait.
+    uint32_t latency_min;
+    uint32_t latency_max;
+    uint32_t latency_last;
+    uint32_t latency_total;
+};
+#endif
+
+struct ltc_sound_engine {
+    // Samples per second the engine renders at.  SAMPLE_RATE unless
+    // engine_set_sample_rate() says otherwise.
+    uint32_t sample_rate;
+
+    // Pool of voices, of which the first `voice_count` are used
+    struct ltc_voice voices[VOICE_LANES];
+    struct ltc_voice_lanes lanes;
+    uint8_t voice_count;
+
+    // Bit N is set if voice N is anything other than PHASE_OFF
+    uint32_t active_voices;
+
+    // One of enum voice_steal_policy
+    uint8_t steal_policy;
+
+    // Serial number given to the most recently started voice
+    uint32_t voice_serial;
+
+    // Songs playing at once, and the pattern channels for each of them
+    // and for sound effects
+    struct ltc_player players[SONG_PLAYERS];
+    struct ltc_channel channels[CHANNEL_SLOTS];
+
+    // Ducked players are turned down to `duck_level` while any sound
+    // effect is playing, moving by `duck_attack` per sample on the way down
+    // and `duck_release` on the way back up.  `duck_gain` is where they
+    // are now.
+    int32_t duck_level;
+    int32_t duck_attack;
+    int32_t duck_release;
+    int32_t duck_gain;
+
+    // The sample the player gains were last brought up to date for
+    uint32_t gain_sample;
+
+    // Samples rendered since engine_init()
+    volatile uint32_t sample_count;
+
+    // The number of ticks that the sound system has gone through.
+    // Overflows after about three days, at 14 kHz.
+    volatile uint32_t tick_counter;
+
+    // Samples waiting for the PWM interrupt
+    struct sample_fifo fifo;
+
+    // If set, SET_INSTRUMENT is ignored and every note uses this instead
+    const struct ltc_instrument_slot *instrument_override;
+
+    // Nonzero to interpolate instruments that support it.  Starts out as
+    // INTERPOLATION_ENABLED, and only affects notes started afterwards.
+    uint8_t interpolation;
+
+    // The same for POLYBLEP_ENABLED and MIPMAPS_ENABLED
+    uint8_t polyblep;
+    uint8_t mipmaps;
+
+    // The same for DITHER_ENABLED and SOFT_CLIP_ENABLED, which take effect
+    // on the next sample
+    uint8_t dither;
+    uint8_t soft_clip;
+
+    // The mix bus's master gain, where GAIN_ONE is 100%
+    int32_t master_gain;
+
+    // The dither's noise generator, and how far the last sample was
+    // rounded, which is taken off the next one
+    uint32_t dither_seed;
+    int32_t dither_error;
+
+    // Bit N is set if voice N is playing a band-limited note
+    uint32_t polyblep_voices;
+
+    // Why setSong() last refused a song
+    struct ltc_song_error song_error;
+
+    // What SET_INSTRUMENT picks from, and why an instrument was last
+    // refused
+    struct ltc_instrument_slot instruments[INSTRUMENT_SLOTS];
+    const char *instrument_error;
+
+#if SFX_CHANNELS
+    struct ltc_sfx_queue sfx_queue;
+
+    // Triggers taken off the queue that are waiting for their sample
+    struct ltc_sfx_trigger sfx_pending[SFX_QUEUE_DEPTH];
+    uint8_t sfx_pending_count;
+
+    // The priority of what each sound effect channel is playing
+    uint8_t sfx_priority[SFX_CHANNELS];
+
+    struct ltc_sfx_stats sfx_stats;
+#endif
+
+#if SONG_STREAMING
+    // Read-ahead for streamed songs, one per song channel
+    struct ltc_song_cache cache[SFX_FIRST_CHANNEL];
+
+    // Reads made while rendering because a word wasn't cached.  Each one
+    // is a sample that waited on I/O.
+    uint32_t cache_misses;
+
+    // Reads made ahead of time
+    uint32_t cache_fills;
+#endif
+
+#ifdef CYCLE_STATS
+    // Timing of every sample since engine_init() or cycle_profile_reset()
+    struct cycle_profile cycles;
+#endif
+};
+
+static struct ltc_sound_engine engine;
+
+// Samples in the next `ticks` ticks on `channel_num`.  The fraction of a
+// sample left over is carried to the channel's next duration, so notes
+// start within a sample of where the tempo puts them however long the song
+// plays.  This runs once per note, never per sample.
+static uint32_t channel_ticks(struct ltc_sound_engine *engine, uint8_t channel_num, uint32_t ticks)
+{
+    struct ltc_channel *channel = &engine->channels[channel_num];
+    uint64_t length = (uint64_t)ticks * engine->players[channel->player].tick_length +
+                      channel->tick_carry;
+
+    channel->tick_carry = length & 0xffff;
+    return length >> 16;
+}
+
+static void patternDelay(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg)
+{
+    engine->channels[channel].rest_duration = channel_ticks(engine, channel, arg);
+}
+
+#if SONG_STREAMING
+// Streamed songs have no patterns in memory.  Their channels point here
+// while they're playing, so that a null pattern still means stopped.
+static const uint16_t streamed_pattern[1] = {0};
+
+static int window_holds(const struct ltc_song_window *window, uint32_t address)
+{
+    return (address - window->start) < window->count;
+}
+
+static void window_fill(const struct ltc_song *song, struct ltc_song_window *window, uint32_t address)
+{
+    window->start = address;
+    window->count = song->source->read(song->source->context, address,
+                                       window->words, SONG_CACHE_WORDS);
+}
+
+// The word at `address` for a channel of a streamed song.  It should have
+// been read ahead by song_prefetch(); if not, read it now and count a miss.
+static uint16_t song_cache_word(struct ltc_sound_engine *engine, uint8_t channel_num, uint32_t address)
+{
+    struct ltc_song_cache *cache = &engine->cache[channel_num];
+    struct ltc_song_window *window = &cache->window[cache->active];
+
+    if (!window_holds(window, address)) {
+        engine->cache_misses++;
+        window_fill(engine->channels[channel_num].song, window, address);
+        if (!window->count)
+            panic("streamed pattern ran off the end of its source");
+    }
+    return window->words[address - window->start];
+}
+
+// A channel just jumped: carry on from whichever window holds the target.
+static void song_cache_jump(struct ltc_sound_engine *engine, uint8_t channel_num)
+{
+    struct ltc_song_cache *cache = &engine->cache[channel_num];
+    uint32_t address = engine->channels[channel_num].pattern_address;
+
+    if (!window_holds(&cache->window[cache->active], address) &&
+        window_holds(&cache->window[cache->active ^ 1], address))
+        cache->active ^= 1;
+}
+
+// Where the first jump in `window` at or after `address` goes, if it can be
+// known yet.  Returns 0 if there's nowhere to prefetch for.
+static int song_next_jump(const struct ltc_sound_engine *engine, const struct ltc_channel *channel,
+                          const struct ltc_song_window *window, uint32_t address, uint32_t *target)
+{
+    const struct ltc_song *song = channel->song;
+    uint32_t i;
+
+    (void)engine;
+    for (i = address - window->start; i < window->count; i++) {
+        uint16_t op = window->words[i];
+        uint8_t arg = op & 0xff;
+
+        if ((op & 0xf000) != 0x8000)
+            continue;
+        switch ((op >> 8) & 0x7f) {
+        case PATTERN_JUMP_ABS:
+            *target = song->pattern_addresses[arg];
+            return 1;
+        case PATTERN_JUMP_REL:
+            *target = song->pattern_addresses[channel->pattern_num + (int8_t)arg];
+            return 1;
+        case PATTERN_REPEAT_COUNT:
+            // A count of 1 is the last time through, and falls through.
+            if (channel->pattern_repeat_count == 1)
+                break;
+            *target = channel->pattern_address;
+            return 1;
+        case CHANNEL_END:
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Read ahead for every channel of the streamed songs: top up the window each
+// channel is reading from, and fill the other with wherever it'll jump to
+// next.  Called between samples that step the sequencer, so that the reads
+// happen before the words are needed rather than when they are.
+static void song_prefetch(struct ltc_sound_engine *engine)
+{
+    int channel_num;
+
+    for (channel_num = 0; channel_num < SFX_FIRST_CHANNEL; channel_num++) {
+        const struct ltc_channel *channel = &engine->channels[channel_num];
+        const struct ltc_song *song = channel->song;
+        struct ltc_song_cache *cache = &engine->cache[channel_num];
+        struct ltc_song_window *window = &cache->window[cache->active];
+        struct ltc_song_window *next = &cache->window[cache->active ^ 1];
+        uint32_t address = channel->pattern_address + channel->pattern_offset;
+        uint32_t target;
+
+        if (!channel->pattern || !song->source)
+            continue;
+
+        if (!window_holds(window, address)) {
+            window_fill(song, window, address);
+            engine->cache_fills++;
+        }
+        else if ((address - window->start) >= SONG_CACHE_WORDS / 2) {
+            // Drop what's been played and read on from where it stopped.
+            uint16_t kept = window->count - (address - window->start);
+
+            memmove(window->words, window->words + (address - window->start),
+                    kept * sizeof(*window->words));
+            window->start = address;
+            window->count = kept + song->source->read(
+                song->source->context, address + kept,
+                window->words + kept, SONG_CACHE_WORDS - kept);
+            engine->cache_fills++;
+        }
+
+        if (song_next_jump(engine, channel, window, address, &target) &&
+            !window_holds(window, target) && !window_holds(next, target)) {
+            window_fill(song, next, target);
+            engine->cache_fills++;
+        }
+    }
+}
+
+// Fetch the next word of a channel's pattern, from memory or the stream.
+static inline uint16_t next_pattern_word(struct ltc_sound_engine *engine, uint8_t channel_num)
+{
+    struct ltc_channel *channel = &engine->channels[channel_num];
+
+    if (channel->song->source)
+        return song_cache_word(engine, channel_num, channel->pattern_address + channel->pattern_offset++);
+    return channel->pattern[channel->pattern_offset++];
+}
+#else
+static inline uint16_t next_pattern_word(struct ltc_sound_engine *engine, uint8_t channel_num)
+{
+    struct ltc_channel *channel = &engine->channels[channel_num];
+
+    return channel->pattern[channel->pattern_offset++];
+}
+#endif
+
+static inline int song_streamed(const struct ltc_song *song)
+{
+#if SONG_STREAMING
+    return song->source != 0;
+#else
+    (void)song;
+    return 0;
+#endif
+}
+
+static inline const uint16_t *song_pattern(const struct ltc_song *song, uint8_t pattern_num)
+{
+    if (song->words)
+        return song->words + song->pattern_addresses[pattern_num];
+    return song->patterns[pattern_num];
+}
+
+static void channel_jump(struct ltc_sound_engine *engine, uint8_t channel_num, uint8_t pattern_num)
+{
+    struct ltc_channel *channel = &engine->channels[channel_num];
+    const struct ltc_song *song = channel->song;
+
+#if SONG_STREAMING
+    if (song->source) {
+        channel->pattern = streamed_pattern;
+        channel->pattern_address = song->pattern_addresses[pattern_num];
+        song_cache_jump(engine, channel_num);
+    }
+    else
+#endif
+    channel->pattern = song_pattern(song, pattern_num);
+#if PREDECODE_PATTERNS
+    // Only the players' own songs are decoded.
+    {
+        struct ltc_player *player = &engine->players[channel->player];
+
+        if (player->decoded && (song == player->song))
+            channel->ops = player->ops + player->pattern_start[pattern_num];
+    }
+#endif
+    channel->pattern_num = pattern_num;
+    channel->pattern_offset = 0;
+    channel->pattern_repeat_count = 0;
+}
+
+static void patternJumpAbs(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg)
+{
+    if (arg >= engine->channels[channel].song->pattern_count) {
+        panic("attempt to abs jump to nonexistent pattern");
+    }
+    channel_jump(engine, channel, arg);
+}
+
+static void patternJumpRel(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg)
+{
+    int8_t target_num = (int8_t)engine->channels[channel].pattern_num + (int8_t)arg;
+    if (target_num >= engine->channels[channel].song->pattern_count) {
+        panic("attempt to rel jump to nonexistent pattern");
+    }
+    if (target_num < 0) {
+        panic("attempt to jump to nonexistent pattern < 0");
+    }
+    channel_jump(engine, channel, target_num);
+}
+
+static void setInstrument(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg)
+{
+    const struct ltc_song *song = engine->channels[channel].song;
+
+    if (song->instruments) {
+        if (arg >= song->instrument_count)
+            panic("instrument is out of range");
+        arg = song->instruments[arg];
+    }
+    if (arg >= INSTRUMENT_SLOTS)
+        panic("instrument is out of range");
+
+    // An instrument taken out since setSong() leaves the channel silent.
+    engine->channels[channel].instrument = engine->instruments[arg].samples ? &engine->instruments[arg] : 0;
+    if (engine->instrument_override)
+        engine->channels[channel].instrument = engine->instrument_override;
+}
+
+// Pattern times are in milliseconds, and are converted to the nearest
+// sample at the engine's rate by the setters below.
+#define MS_TO_SAMPLES(engine, ms) (((ms) * (engine)->sample_rate + 500) / 1000)
+
+// Song speeds are in samples per tick at SAMPLE_RATE, the rate the device
+// runs at.  This gives a player's tick_length for one at the engine's rate,
+// to the nearest 1/65536th of a sample, so songs keep their tempo at any
+// rate.
+static inline uint32_t song_tick_length(const struct ltc_sound_engine *engine, uint32_t speed)
+{
+    if (engine->sample_rate == SAMPLE_RATE)
+        return speed << 16;
+    return (((uint64_t)speed << 16) * engine->sample_rate + SAMPLE_RATE / 2) / SAMPLE_RATE;
+}
+
+static void setAttackTime(struct ltc_sound_engine *engine, uint8_t channel, uint16_t arg)
+{
+    engine->channels[channel].adsr.attack_time = MS_TO_SAMPLES(engine, (uint32_t)arg);
+}
+
+static void setAttackLevel(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg)
+{
+    engine->channels[channel].adsr.attack_level = (arg > ENVELOPE_MAX_LEVEL) ? ENVELOPE_MAX_LEVEL : arg;
+}
+
+static void setDecayLevel(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg)
+{
+    engine->channels[channel].adsr.decay_level = (arg > ENVELOPE_MAX_LEVEL) ? ENVELOPE_MAX_LEVEL : arg;
+}
+
+static void setDecayTime(struct ltc_sound_engine *engine, uint8_t channel, uint16_t arg)
+{
+    engine->channels[channel].adsr.decay_time = MS_TO_SAMPLES(engine, (uint32_t)arg);
+}
+
+static void setSustainLevel(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg)
+{
+    engine->channels[channel].adsr.sustain_level = (arg > ENVELOPE_MAX_LEVEL) ? ENVELOPE_MAX_LEVEL : arg;
+}
+
+static void setReleaseTime(struct ltc_sound_engine *engine, uint8_t channel, uint16_t arg)
+{
+    engine->channels[channel].adsr.release_time = MS_TO_SAMPLES(engine, (uint32_t)arg);
+}
+
+static void setGlobalSpeed(struct ltc_sound_engine *engine, uint8_t channel, uint16_t arg)
+{
+    engine->players[engine->channels[channel].player].tick_length = song_tick_length(engine, arg);
+}
+
+static void setMiddleC(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg) {
+    engine->channels[channel].middle_c = arg;
+}
+
+static void patternRepeatCount(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg) {
+    struct ltc_channel *chan = &engine->channels[channel];
+    int new_count = chan->pattern_repeat_count - 1;
+
+    // If pattern_repeat_count is nonzero, then we're in the middle of repeating.
+    switch (chan->pattern_repeat_count) {
+    // If it's 1, then it's a NOP, since we've already processed it
+    // during this iteration of a pattern.  Must jump to a new pattern
+    // first.
+    case 1:
+        break;
+    case 0:
+        new_count = arg - 1;
+        /* Fall through */
     default:
         // Repeat the pattern
         patternJumpRel(engine, channel, 0);
 
-        // Update pattern_repeat_count, which is cleared as part of the jump.
-        voice->pattern_repeat_count = new_count;
+        // Update pattern_repeat_count, which is cleared as part of the jump.
+        chan->pattern_repeat_count = new_count;
+
+        break;
+    }
+}
+
+static void channelEnd(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg) {
+    (void)arg;
+    engine->channels[channel].pattern = 0;
+}
+
+#if RAW_PATTERNS
+typedef void (*effect_t)(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg);
+
+static const effect_t effect_lut[] = {
+    0,
+    patternDelay,
+    patternJumpAbs,
+    setInstrument,
+    setAttackLevel,
+    setDecayLevel,
+    setSustainLevel,
+    setMiddleC,
+    patternJumpRel,
+    patternRepeatCount,
+    channelEnd,
+};
+#endif
+
+// Defined with the voice kernels, further down
+static void voice_pick_kernel(struct ltc_sound_engine *engine, uint8_t voice_num);
+
+static void adsr_enter_phase(struct ltc_sound_engine *engine, uint8_t voice_num, uint8_t phase)
+{
+    struct ltc_voice *voice = &engine->voices[voice_num];
+    struct ltc_voice_lanes *lanes = &engine->lanes;
+    uint32_t start = 0, end = 0, time = 0;
+    uint8_t next;
+
+#ifdef DEBUG_ADSR
+    print_phase(voice->adsr_phase);
+    fprintf(stderr, " -> ");
+    print_phase(phase);
+    fprintf(stderr, "\n");
+#endif
+
+    CYCLE_NOTE_TRANSITION(engine);
+
+    // Phases with a length of 0 are skipped entirely.
+    for (;;) {
+        switch (phase) {
+        /* For the ATTACK phase, the level starts at at voice->attack_level
+         * and ends at voice->decay_level, during the course of voice->attack_time.
+         */
+        case PHASE_ATTACK:
+            start = voice->adsr.attack_level;
+            end = voice->adsr.decay_level;
+            time = voice->adsr.attack_time;
+            next = PHASE_DECAY;
+            break;
+
+        case PHASE_DECAY:
+            start = voice->adsr.decay_level;
+            end = voice->adsr.sustain_level;
+            time = voice->adsr.decay_time;
+            next = PHASE_SUSTAIN;
+            break;
+
+        case PHASE_RELEASE:
+            start = voice->adsr.sustain_level;
+            end = 0;
+            time = voice->adsr.release_time;
+            next = PHASE_OFF;
+            break;
+
+        case PHASE_SUSTAIN:
+            start = voice->adsr.sustain_level;
+            /* Fall through */
+        case PHASE_OFF:
+        default:
+            // These phases hold their level until the sequencer moves on.
+            voice->adsr_phase = phase;
+            lanes->envelope_level[voice_num] = ENVELOPE_LEVEL(start);
+            lanes->envelope_step[voice_num] = 0;
+            lanes->envelope_remaining[voice_num] = 0;
+            if (phase == PHASE_OFF)
+                engine->active_voices &= ~(1UL << voice_num);
+            else
+                engine->active_voices |= 1UL << voice_num;
+            voice_pick_kernel(engine, voice_num);
+            return;
+        }
+
+        if (time)
+            break;
+        phase = next;
+    }
+
+    // This is the only divide in the envelope, and it happens once per phase.
+    voice->adsr_phase = phase;
+    lanes->envelope_level[voice_num] = ENVELOPE_LEVEL(start);
+    lanes->envelope_step[voice_num] = (ENVELOPE_LEVEL(end) - ENVELOPE_LEVEL(start)) / (int32_t)time;
+    lanes->envelope_remaining[voice_num] = time;
+    engine->active_voices |= 1UL << voice_num;
+    voice_pick_kernel(engine, voice_num);
+}
+
+// Called once a voice's envelope_remaining runs out.
+static void adsr_phase_done(struct ltc_sound_engine *engine, uint8_t voice_num)
+{
+    switch (engine->voices[voice_num].adsr_phase) {
+    case PHASE_ATTACK:
+        ADSR_PHASE(engine, voice_num, PHASE_DECAY);
+        break;
+    case PHASE_DECAY:
+        ADSR_PHASE(engine, voice_num, PHASE_SUSTAIN);
+        break;
+    case PHASE_RELEASE:
+        ADSR_PHASE(engine, voice_num, PHASE_OFF);
+        break;
+    }
+}
+
+// Idle voices play this, which keeps every lane safe to mix.
+static const int8_t silent_samples[1] = {0};
+
+static void reset_voices(struct ltc_sound_engine *engine)
+{
+    int voice_num;
+
+    for (voice_num = 0; voice_num < VOICE_LANES; voice_num++) {
+        struct ltc_voice *voice = &engine->voices[voice_num];
+        ADSR_PHASE(engine, voice_num, PHASE_OFF);
+        voice->instrument = 0;
+        voice->owner = NO_CHANNEL;
+        voice->serial = 0;
+        engine->lanes.phase_accumulator[voice_num] = 0;
+        engine->lanes.phase_increment[voice_num] = 0;
+        engine->lanes.samples[voice_num] = silent_samples;
+        engine->lanes.length[voice_num] = 1;
+        engine->lanes.distance_mask[voice_num] = 0;
+        engine->lanes.noise_state[voice_num] = 0;
+        engine->lanes.noise_taps[voice_num] = 0;
+        engine->lanes.gain[voice_num] = GAIN_ONE;
+    }
+    engine->voice_serial = 0;
+}
+
+static void reset_channels(struct ltc_sound_engine *engine)
+{
+    int channel_num;
+
+    memset(engine->channels, 0, sizeof(engine->channels));
+    for (channel_num = 0; channel_num < (int)ARRAY_SIZE(engine->channels); channel_num++)
+        engine->channels[channel_num].voice = NO_VOICE;
+}
+
+static uint8_t voice_kernel_length(uint32_t length);
+
+// The flags engine_register_instrument() knows what to do with
+#define INSTRUMENT_FLAGS (INSTRUMENT_CAN_INTERPOLATE | INSTRUMENT_POLYBLEP | INSTRUMENT_NOISE)
+
+// The furthest a noise instrument's LFSR can be clocked above its notes.
+// The clock never runs faster than the sample rate anyway.
+#define NOISE_MAX_SHIFT 8
+
+static int instrument_refuse(struct ltc_sound_engine *engine, const char *message)
+{
+    engine->instrument_error = message;
+    return -1;
+}
+
+// Put `instrument` in `slot`, for SET_INSTRUMENT to pick, or empty the slot
+// if `instrument` is NULL.  The tables are used in place, from RAM or
+// flash, so they have to stay put while the engine can play them; the
+// struct itself is copied.  Notes already playing keep the table they
+// started with, and songs pick up the change on their next SET_INSTRUMENT.
+// Register instruments before the songs that use them, since setSong()
+// refuses songs that pick empty slots.  Returns 0, or -1 with
+// engine->instrument_error set.
+int engine_register_instrument(struct ltc_sound_engine *engine, uint8_t slot,
+                               const struct ltc_instrument *instrument)
+{
+    struct ltc_instrument_slot *entry;
+    uint8_t level;
+
+    if (slot >= INSTRUMENT_SLOTS)
+        return instrument_refuse(engine, "instrument slot is out of range");
+    entry = &engine->instruments[slot];
+    if (!instrument) {
+        memset(entry, 0, sizeof(*entry));
+        return 0;
+    }
+
+    if (!instrument->samples || !instrument->length)
+        return instrument_refuse(engine, "instrument has no samples");
+    if (instrument->flags & ~INSTRUMENT_FLAGS)
+        return instrument_refuse(engine, "instrument has unknown flags");
+    if (instrument->level_count && !instrument->levels)
+        return instrument_refuse(engine, "instrument's band-limited levels are missing");
+    for (level = 0; level < instrument->level_count; level++) {
+        const struct ltc_wave_level *wave = &instrument->levels[level];
+
+        if (!wave->samples || !wave->length || !wave->harmonics)
+            return instrument_refuse(engine, "instrument has an empty band-limited level");
+        if (level && (wave->harmonics >= instrument->levels[level - 1].harmonics))
+            return instrument_refuse(engine, "instrument's band-limited levels aren't richest first");
+    }
+    // Noise is indexed by the LFSR's low bits, so there's nothing to
+    // interpolate or band-limit, and the table must be a power of two.
+    if (instrument->flags & INSTRUMENT_NOISE) {
+        if (instrument->flags & (INSTRUMENT_CAN_INTERPOLATE | INSTRUMENT_POLYBLEP))
+            return instrument_refuse(engine, "noise instruments can't interpolate or be band-limited");
+        if (instrument->level_count)
+            return instrument_refuse(engine, "noise instruments can't have band-limited levels");
+        if (instrument->length & (instrument->length - 1))
+            return instrument_refuse(engine, "noise instrument's table isn't a power of two long");
+        if (!instrument->noise_taps)
+            return instrument_refuse(engine, "noise instrument has no LFSR taps");
+        if (instrument->noise_shift > NOISE_MAX_SHIFT)
+            return instrument_refuse(engine, "noise instrument's clock shift is out of range");
+    }
+
+    entry->samples = instrument->samples;
+    entry->levels = instrument->levels;
+    entry->length = instrument->length;
+    entry->flags = instrument->flags;
+    entry->level_count = instrument->level_count;
+    entry->distance_mask = (instrument->flags & INSTRUMENT_CAN_INTERPOLATE) ? PHASEACC_MAX - 1 : 0;
+    entry->kernel_length = voice_kernel_length(instrument->length);
+    entry->harmonics = instrument->length / 2;
+    entry->noise_taps = (instrument->flags & INSTRUMENT_NOISE) ? instrument->noise_taps : 0;
+    entry->noise_shift = (instrument->flags & INSTRUMENT_NOISE) ? instrument->noise_shift : 0;
+    return 0;
+}
+
+// Prepare an engine with a pool of `voice_count` voices.  When every voice
+// is busy, starting a new note cuts one off according to `steal_policy`.
+void engine_init(struct ltc_sound_engine *engine, uint8_t voice_count,
+                 enum voice_steal_policy steal_policy)
+{
+    int player_num, slot;
+
+    memset(engine, 0, sizeof(*engine));
+
+    engine->sample_rate = SAMPLE_RATE;
+    if (voice_count < 1)
+        voice_count = 1;
+    if (voice_count > MAX_VOICES)
+        voice_count = MAX_VOICES;
+    engine->voice_count = voice_count;
+    engine->steal_policy = steal_policy;
+    engine->interpolation = INTERPOLATION_ENABLED;
+    engine->polyblep = POLYBLEP_ENABLED;
+    engine->mipmaps = MIPMAPS_ENABLED;
+    engine->dither = DITHER_ENABLED;
+    engine->soft_clip = SOFT_CLIP_ENABLED;
+    engine->master_gain = GAIN_ONE;
+    engine->dither_seed = 2463534242u;
+    for (player_num = 0; player_num < SONG_PLAYERS; player_num++) {
+        struct ltc_player *player = &engine->players[player_num];
+
+        player->voices = UINT32_MAX;
+        player->gain = GAIN_ONE;
+        player->mixed_gain = GAIN_ONE;
+        player->ducked = 1;
+    }
+    engine->duck_level = GAIN_ONE;
+    engine->duck_gain = GAIN_ONE;
+    engine->duck_attack = GAIN_ONE;
+    engine->duck_release = GAIN_ONE;
+    for (slot = 0; slot < (int)ARRAY_SIZE(instruments); slot++)
+        engine_register_instrument(engine, slot, instruments[slot]);
+    reset_channels(engine);
+    reset_voices(engine);
+}
+
+// The rates engine_set_sample_rate() takes.  Much above the top one the
+// phase accumulator can't pitch low notes accurately.
+#define ENGINE_MIN_RATE 4000
+#define ENGINE_MAX_RATE 48000
+
+// Render at `rate` samples a second instead of SAMPLE_RATE.  Songs keep
+// their pitch and tempo, and envelope times stay in milliseconds.  Call it
+// before setSong(); returns -1 if the rate is out of range.
+int engine_set_sample_rate(struct ltc_sound_engine *engine, uint32_t rate)
+{
+    if ((rate < ENGINE_MIN_RATE) || (rate > ENGINE_MAX_RATE))
+        return -1;
+    engine->sample_rate = rate;
+    return 0;
+}
+
+// Channels start out with notes relative to this one.
+#define DEFAULT_MIDDLE_C 40
+
+// Handlers for decoded ops.  Effects keep their effect number, and the
+// slot for effect 0, which doesn't exist, is used for notes.
+enum ltc_op_handler {
+    OP_NOTE = 0,
+    OP_SET_SPEED = FINAL_EFFECT,
+    OP_SET_ATTACK_TIME,
+    OP_SET_DECAY_TIME,
+    OP_SET_RELEASE_TIME,
+    OP_HANDLER_COUNT,
+};
+
+static int song_error(struct ltc_song_error *error, const char *message,
+                      uint8_t pattern, uint16_t offset)
+{
+    error->message = message;
+    error->pattern = pattern;
+    error->offset = offset;
+    return -1;
+}
+
+// Whether SET_INSTRUMENT can pick `slot` on `engine`, or just whether
+// `slot` is in range if `engine` is NULL.
+static int instrument_exists(const struct ltc_sound_engine *engine, uint8_t slot)
+{
+    if (slot >= INSTRUMENT_SLOTS)
+        return 0;
+    return !engine || engine->instruments[slot].samples;
+}
+
+// Check every pattern in `song` against the instruments `engine` has, so
+// that nothing can go wrong once it's playing.  If `ops` is set, also decode the patterns into it back to back,
+// with pattern N starting at ops[pattern_start[N]].
+//
+// Patterns don't record their length, so each one is read up to its first
+// jump or CHANNEL_END.  Notes are checked against every middle C the song
+// can set, which may turn away a song that would in fact have stayed in
+// range.  Returns 0, or -1 with `error` filled in.
+static int song_decode(const struct ltc_sound_engine *engine, const struct ltc_song *song,
+                       struct ltc_op *ops, uint16_t *pattern_start, struct ltc_song_error *error)
+{
+    int min_c = DEFAULT_MIDDLE_C, max_c = DEFAULT_MIDDLE_C;
+    int min_note = 0, max_note = 0;
+    uint16_t min_at[2] = {0, 0}, max_at[2] = {0, 0};
+    uint32_t count = 0;
+    int pattern_num;
+
+    if (!song->channel_count || (song->channel_count > song->pattern_count))
+        return song_error(error, "song needs a pattern for each channel", 0, 0);
+    for (pattern_num = 0; song->instruments && (pattern_num < song->instrument_count); pattern_num++)
+        if (!instrument_exists(engine, song->instruments[pattern_num]))
+            return song_error(error, "song uses an instrument that doesn't exist", 0, 0);
+
+    for (pattern_num = 0; pattern_num < song->pattern_count; pattern_num++) {
+        const uint16_t *pattern = song_streamed(song) ? 0 : song_pattern(song, pattern_num);
+        uint16_t offset;
+        int done = 0;
+#if SONG_STREAMING
+        // Streamed patterns are read a window at a time.
+        struct ltc_song_window window;
+
+        window.start = 0;
+        window.count = 0;
+#endif
+
+        if (pattern_start)
+            pattern_start[pattern_num] = count;
+
+        for (offset = 0; !done; offset++, count++) {
+            struct ltc_op decoded = {0, 0, 0};
+            uint16_t op;
+
+            if (offset >= PATTERN_MAX_OPS)
+                return song_error(error, "pattern never jumps or ends", pattern_num, offset);
+            if (song->pattern_addresses && (song->pattern_addresses[pattern_num] + offset >= song->word_count))
+                return song_error(error, "pattern runs off the end of the song", pattern_num, offset);
+#if SONG_STREAMING
+            if (!pattern) {
+                if (!window_holds(&window, song->pattern_addresses[pattern_num] + offset)) {
+                    window_fill(song, &window, song->pattern_addresses[pattern_num] + offset);
+                    if (!window.count)
+                        return song_error(error, "pattern runs off the end of the song", pattern_num, offset);
+                }
+                op = window.words[song->pattern_addresses[pattern_num] + offset - window.start];
+            }
+            else
+#endif
+            op = pattern[offset];
+
+            if ((op & 0xf000) == 0x8000) {
+                uint8_t effect_num = (op >> 8) & 0x7f;
+                uint8_t arg = op & 0xff;
+                int target;
+
+                if (!effect_num || (effect_num >= FINAL_EFFECT))
+                    return song_error(error, "unknown effect", pattern_num, offset);
+                decoded.handler = effect_num;
+                decoded.arg = arg;
+
+                switch (effect_num) {
+                case PATTERN_JUMP_ABS:
+                    if (arg >= song->pattern_count)
+                        return song_error(error, "jump to nonexistent pattern", pattern_num, offset);
+                    done = 1;
+                    break;
+
+                // Relative jumps become absolute ones.
+                case PATTERN_JUMP_REL:
+                    target = pattern_num + (int8_t)arg;
+                    if ((target < 0) || (target >= song->pattern_count))
+                        return song_error(error, "jump to nonexistent pattern", pattern_num, offset);
+                    decoded.handler = PATTERN_JUMP_ABS;
+                    decoded.arg = target;
+                    done = 1;
+                    break;
+
+                case CHANNEL_END:
+                    done = 1;
+                    break;
+
+                case SET_INSTRUMENT:
+                    if (song->instruments && (arg >= song->instrument_count))
+                        return song_error(error, "instrument is out of range", pattern_num, offset);
+                    if (!song->instruments && !instrument_exists(engine, arg))
+                        return song_error(error, "instrument is out of range", pattern_num, offset);
+                    break;
+
+                case SET_ATTACK_LEVEL:
+                case SET_DECAY_LEVEL:
+                case SET_SUSTAIN_LEVEL:
+                    if (arg > ENVELOPE_MAX_LEVEL)
+                        return song_error(error, "envelope level is over 100", pattern_num, offset);
+                    break;
+
+                case SET_MIDDLE_C:
+                    if (arg < min_c)
+                        min_c = arg;
+                    if (arg > max_c)
+                        max_c = arg;
+                    break;
+                }
+            }
+            else if ((op & 0xf000) == 0x9000) {
+                decoded.handler = OP_SET_SPEED;
+                decoded.value = op & 0xfff;
+            }
+            else if (((op & 0xf000) >= 0xa000) && ((op & 0xf000) <= 0xc000)) {
+                decoded.handler = OP_SET_ATTACK_TIME + ((op >> 12) - 0xa);
+                decoded.value = op & 0xfff;
+            }
+            else if (op & 0x8000) {
+                return song_error(error, "unknown op", pattern_num, offset);
+            }
+            else {
+                int note = (op & 0x1f) - 16;
+
+                if (note < min_note) {
+                    min_note = note;
+                    min_at[0] = pattern_num;
+                    min_at[1] = offset;
+                }
+                if (note > max_note) {
+                    max_note = note;
+                    max_at[0] = pattern_num;
+                    max_at[1] = offset;
+                }
+                decoded.handler = OP_NOTE;
+                decoded.arg = (uint8_t)note;
+                decoded.value = ((op >> 10) & 0x1f) | (((op >> 5) & 0x1f) << 8);
+            }
+
+            if (ops) {
+                if (count >= DECODED_MAX_OPS)
+                    return song_error(error, "song is too long to decode", pattern_num, offset);
+                ops[count] = decoded;
+            }
+        }
+    }
+
+    if (min_c + min_note < 0)
+        return song_error(error, "note is below the note table", min_at[0], min_at[1]);
+    if (max_c + max_note >= (int)ARRAY_SIZE(note_lut))
+        return song_error(error, "note is above the note table", max_at[0], max_at[1]);
+    return 0;
+}
+
+// Check `song` and, unless it is streamed, decode it for player
+// `player_num`, which must not be playing.  Returns 0, or -1 with
+// engine->song_error filled in.
+static int player_load(struct ltc_sound_engine *engine, uint8_t player_num,
+                       const struct ltc_song *song)
+{
+    struct ltc_player *player = &engine->players[player_num];
+
+#if PREDECODE_PATTERNS
+    // Streamed songs are played straight from the stream instead.
+    player->decoded = !song_streamed(song);
+    if (song_decode(engine, song, player->decoded ? player->ops : 0, player->pattern_start,
+                    &engine->song_error))
+#else
+    if (song_decode(engine, song, 0, 0, &engine->song_error))
+#endif
+        return -1;
+
+    player->song = song;
+    player->channel_count = song->channel_count;
+    if (player->channel_count > MAX_CHANNELS)
+        player->channel_count = MAX_CHANNELS;
+    return 0;
+}
+
+// A song container holds a whole song in one blob, so new songs can go in
+// flash or a file without a rebuild.  Everything is little-endian:
+//
+//    0  "LTCS"
+//    4  version (u16), SONG_CONTAINER_VERSION
+//    6  header size in bytes (u16), a multiple of 4 and at least 24
+//    8  channel count, pattern count, instrument count (u8 each), then 0
+//   12  speed in loops per tick, or 0 (u16), then 0 (u16)
+//   16  size of the container in words (u32)
+//   20  FNV-1a of every byte after the header (u32)
+//
+// After the header come the pattern addresses, in words from the start of
+// the container (u32 each), the instrument numbers SET_INSTRUMENT picks
+// from (u8 each, padded to a word), and then the patterns.
+#define SONG_CONTAINER_MAGIC "LTCS"
+#define SONG_CONTAINER_VERSION 1
+#define SONG_HEADER_BYTES 24
+
+// Where the tables are in a container, from song_container_header().
+struct ltc_song_layout {
+    uint32_t addresses;     // Byte offset of the pattern addresses
+    uint32_t instruments;   // Byte offset of the instrument numbers
+    uint32_t checksum;      // Expected FNV-1a of the bytes from `addresses` on
+};
+
+static inline uint16_t get_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+    return get_le16(p) | ((uint32_t)get_le16(p + 2) << 16);
+}
+
+// Fold `count` bytes into an FNV-1a hash.  Start from 2166136261.
+uint32_t song_checksum(uint32_t hash, const uint8_t *bytes, uint32_t count)
+{
+    while (count--)
+        hash = (hash ^ *bytes++) * 16777619u;
+    return hash;
+}
+
+// Check the fixed header of a `size`-byte container, and fill in the
+// counts, speed and word_count of `song` from it.  The tables and patterns
+// aren't touched, so this works on a header read from storage.
+int song_container_header(struct ltc_song *song, struct ltc_song_layout *layout,
+                          const uint8_t *header, uint32_t size,
+                          struct ltc_song_error *error)
+{
+    uint32_t header_bytes, tables_end;
+
+    if ((size < SONG_HEADER_BYTES) || memcmp(header, SONG_CONTAINER_MAGIC, 4))
+        return song_error(error, "not a song container", 0, 0);
+    if (get_le16(header + 4) != SONG_CONTAINER_VERSION)
+        return song_error(error, "unsupported song container version", 0, 0);
+
+    memset(song, 0, sizeof(*song));
+    song->channel_count = header[8];
+    song->pattern_count = header[9];
+    song->instrument_count = header[10];
+    song->speed = get_le16(header + 12);
+    song->word_count = get_le32(header + 16);
+
+    header_bytes = get_le16(header + 6);
+    layout->addresses = header_bytes;
+    layout->instruments = header_bytes + 4 * song->pattern_count;
+    layout->checksum = get_le32(header + 20);
+    tables_end = layout->instruments + ((song->instrument_count + 1) & ~1);
+
+    if ((header_bytes < SONG_HEADER_BYTES) || (header_bytes & 3))
+        return song_error(error, "bad song container header size", 0, 0);
+    if ((song->word_count > size / 2) || (song->word_count * 2 < tables_end))
+        return song_error(error, "song container is truncated", 0, 0);
+    return 0;
+}
+
+// Point `song` at a container that's already in memory, such as in flash
+// or mapped from a file.  Nothing is copied, so the container has to stay
+// put, and be 4-byte aligned.  Pass `song` to setSong() to check the
+// patterns themselves.  Returns 0, or -1 with `error` filled in.
+int song_load(struct ltc_song *song, const void *container, uint32_t size,
+              struct ltc_song_error *error)
+{
+    const uint8_t *bytes = (const uint8_t *)container;
+    struct ltc_song_layout layout;
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    // The tables are used in place, so they have to be in our byte order.
+    return song_error(error, "song containers need a little-endian CPU", 0, 0);
+#endif
+    if ((uintptr_t)container & 3)
+        return song_error(error, "song container isn't 4-byte aligned", 0, 0);
+    if (song_container_header(song, &layout, bytes, size, error))
+        return -1;
+    if (song_checksum(2166136261u, bytes + layout.addresses,
+                      song->word_count * 2 - layout.addresses) != layout.checksum)
+        return song_error(error, "song container checksum doesn't match", 0, 0);
+
+    song->words = (const uint16_t *)container;
+    song->pattern_addresses = (const uint32_t *)(bytes + layout.addresses);
+    if (song->instrument_count)
+        song->instruments = bytes + layout.instruments;
+    return 0;
+}
+
+// An instrument container holds one instrument's table, so new timbres can
+// be loaded from flash or a file without a rebuild.  Everything is
+// little-endian:
+//
+//    0  "LTCI"
+//    4  version (u16), INSTRUMENT_CONTAINER_VERSION
+//    6  flags (u16), as in struct ltc_instrument
+//    8  table length in samples (u16), then 0 (u16)
+//   12  FNV-1a of the samples (u32)
+//   16  noise taps (u16), noise clock shift (u8), then 0 (u8)
+//
+// The samples follow, one signed byte each.  Version 1 containers stop
+// the header at 16 bytes and have no noise settings.
+#define INSTRUMENT_CONTAINER_MAGIC "LTCI"
+#define INSTRUMENT_CONTAINER_VERSION 2
+#define INSTRUMENT_HEADER_BYTES 20
+#define INSTRUMENT_V1_HEADER_BYTES 16
+
+// Register the instrument in a `size`-byte container in `slot`.  The
+// samples are played in place, so the container has to stay put.  Returns
+// 0, or -1 with engine->instrument_error set.
+int engine_load_instrument(struct ltc_sound_engine *engine, uint8_t slot,
+                           const void *container, uint32_t size)
+{
+    const uint8_t *bytes = (const uint8_t *)container;
+    uint32_t header = INSTRUMENT_HEADER_BYTES;
+    uint16_t length, version;
+
+    if ((size < INSTRUMENT_V1_HEADER_BYTES) || memcmp(bytes, INSTRUMENT_CONTAINER_MAGIC, 4))
+        return instrument_refuse(engine, "not an instrument container");
+    version = get_le16(bytes + 4);
+    if (version == 1)
+        header = INSTRUMENT_V1_HEADER_BYTES;
+    else if (version != INSTRUMENT_CONTAINER_VERSION)
+        return instrument_refuse(engine, "unsupported instrument container version");
+    length = get_le16(bytes + 8);
+    if ((size < header) || (size - header < length))
+        return instrument_refuse(engine, "instrument container is truncated");
+    if (song_checksum(2166136261u, bytes + header, length) != get_le32(bytes + 12))
+        return instrument_refuse(engine, "instrument container checksum doesn't match");
+
+    {
+        const struct ltc_instrument instrument = {
+            .samples = (const int8_t *)(bytes + header),
+            .length = length,
+            .flags = get_le16(bytes + 6),
+            .noise_taps = (uint16_t)((version == 1) ? 0 : get_le16(bytes + 16)),
+            .noise_shift = (uint8_t)((version == 1) ? 0 : bytes[18]),
+        };
+
+        return engine_register_instrument(engine, slot, &instrument);
+    }
+}
+
+#define ATTACK_PHASE 1
+#define DECAY_PHASE 2
+#define SUSTAIN_PHASE 3
+#define RELEASE_PHASE 4
+#ifdef DEBUG
+#define DEBUG_PHASE(x) do { \
+writel((1 << 12), (x == ATTACK_PHASE) ? FGPIOA_PSOR : FGPIOA_PCOR); \
+writel((1 << 13), (x == DECAY_PHASE) ? FGPIOB_PSOR : FGPIOB_PCOR); \
+writel((1 << 0), (x == SUSTAIN_PHASE) ? FGPIOB_PSOR : FGPIOB_PCOR); \
+writel((1 << 7), (x == RELEASE_PHASE) ? FGPIOA_PSOR : FGPIOA_PCOR); \
+} while(0);
+#else
+#define DEBUG_PHASE(x)
+#endif
+// Apply the envelope to one sample.  The level and its per-sample step were
+// worked out when the phase began, so this is an add and a multiply-shift.
+// Compared with the old percentage-based envelope, each voice's output
+// differs by at most 3 LSBs: the level no longer snaps down to a whole
+// percent (up to 1.27 LSBs at full scale), and the shift rounds toward
+// negative infinity rather than toward zero.
+static int32_t processADSR(struct ltc_sound_engine *engine, uint8_t voice_num, int32_t output)
+{
+    struct ltc_voice_lanes *lanes = &engine->lanes;
+    int32_t envelope;
+
+    if (engine->voices[voice_num].adsr_phase == PHASE_OFF)
+        return 0;
+
+    lanes->envelope_level[voice_num] += lanes->envelope_step[voice_num];
+
+    /* Scale the note volume to the calculated level and the player's gain */
+    envelope = lanes->envelope_level[voice_num] >> (ENVELOPE_BITS - ENVELOPE_GAIN_BITS);
+    if (lanes->gain[voice_num] != GAIN_ONE)
+        envelope = (envelope * lanes->gain[voice_num]) >> ENVELOPE_GAIN_BITS;
+    output = (output * envelope) >> VOICE_SHIFT;
+
+    if (lanes->envelope_remaining[voice_num] && !--lanes->envelope_remaining[voice_num])
+        adsr_phase_done(engine, voice_num);
+
+    return output;
+}
+
+// The PolyBLEP correction for an edge of `height` that the phase passed
+// `since` ago, where `reciprocal` is (1 << 28) / increment.  Within one
+// sample either side of the edge, this adds a two-sample polynomial step
+// that cancels most of what would otherwise alias.
+static inline int32_t polyblep(uint32_t since, uint32_t increment,
+                               uint32_t reciprocal, int32_t height)
+{
+    int32_t x;
+
+    // Just after the edge: -(1 - t/dt)^2
+    if (since < increment) {
+        x = PHASEACC_MAX - ((since * reciprocal) >> PHASEACC_BITS);
+        return -((height * ((x * x) >> PHASEACC_BITS)) >> (PHASEACC_BITS + 1));
+    }
+
+    // Just before it: (1 - (1 - t)/dt)^2
+    since = PHASEACC_MAX - since;
+    if (since <= increment) {
+        x = PHASEACC_MAX - ((since * reciprocal) >> PHASEACC_BITS);
+        return (height * ((x * x) >> PHASEACC_BITS)) >> (PHASEACC_BITS + 1);
+    }
+    return 0;
+}
+
+// One sample of a band-limited voice.  Between edges the table is
+// interpolated, carrying on the slope up to an edge rather than blending
+// across it, and each edge gets a PolyBLEP correction.
+static int32_t polyblep_sample(struct ltc_sound_engine *engine, uint8_t voice_num,
+                               uint32_t phase)
+{
+    const struct ltc_voice *voice = &engine->voices[voice_num];
+    const struct ltc_voice_lanes *lanes = &engine->lanes;
+    const int8_t *samples = lanes->samples[voice_num];
+    uint32_t length = lanes->length[voice_num];
+    uint32_t increment = lanes->phase_increment[voice_num];
+    uint32_t scaled = phase * length;
+    uint32_t position = scaled >> PHASEACC_BITS;
+    int32_t distance = scaled & (PHASEACC_MAX - 1);
+    int32_t v1 = samples[position];
+    int32_t v2 = samples[(position + 1 < length) ? position + 1 : 0];
+    int32_t output;
+    int edge;
+
+    if ((v2 - v1 > 128) || (v1 - v2 > 128))
+        v2 = v1 + (v1 - samples[position ? position - 1 : length - 1]);
+
+    output = (v1 * (PHASEACC_MAX - distance)) + (v2 * distance);
+    if (output < 0)
+        output += PHASEACC_MAX - 1;
+    output >>= PHASEACC_BITS;
+
+    for (edge = 0; edge < 2; edge++)
+        if (voice->edge_height[edge])
+            output += polyblep((phase - voice->edge_phase[edge]) & (PHASEACC_MAX - 1),
+                               increment, voice->phase_reciprocal,
+                               voice->edge_height[edge]);
+    return output;
+}
+
+// One sample of a voice, as a kernel would render it.  Each argument after
+// `voice_num` is a constant in every kernel, so the tests on them fold
+// away: `table_length` is the length of the voice's table, or 0 for any
+// length, and `ramp` is set if the envelope is moving, in which case its
+// phase has samples left to run.  `noise` voices play their table from an
+// LFSR that steps each time the phase wraps, and `apply_gain` is set for
+// voices whose player isn't at full gain.
+static ALWAYS_INLINE int32_t voice_render(struct ltc_sound_engine *engine, uint8_t voice_num,
+                                          uint32_t table_length, int interpolate,
+                                          int ramp, int band_limited, int noise, int apply_gain)
+{
+    struct ltc_voice_lanes *lanes = &engine->lanes;
+    const int8_t *samples = lanes->samples[voice_num];
+    uint32_t length = table_length ? table_length : lanes->length[voice_num];
+    uint32_t stepped, phase, scaled, position;
+    int32_t output, envelope;
+
+    // add this to the phase accumulator, and wrap it around
+    stepped = lanes->phase_accumulator[voice_num] + lanes->phase_increment[voice_num];
+    phase = stepped & (PHASEACC_MAX - 1);
+    lanes->phase_accumulator[voice_num] = phase;
+
+    // Scale the phase by the table length rather than dividing it by
+    // PHASEACC_MAX.  Because PHASEACC_MAX is a power of two, the table
+    // position ends up in the high bits and the distance to the next entry
+    // (in 1/PHASEACC_MAX steps) in the low bits, with no divide.
+    scaled = phase * length;
+    position = scaled >> PHASEACC_BITS;
+
+    if (noise)
+    {
+        // The increment is at most PHASEACC_MAX, so the phase wraps at most
+        // once and `clock` is 0 or 1.  Stepping the register is then a
+        // shift by `clock` and an XOR of the taps if a 1 was shifted out,
+        // with no branches.
+        uint32_t state = lanes->noise_state[voice_num];
+        uint32_t clock = stepped >> PHASEACC_BITS;
+        uint32_t out_bit = state & clock;
+
+        state = (state >> clock) ^ (-out_bit & lanes->noise_taps[voice_num]);
+        lanes->noise_state[voice_num] = state;
+        output = samples[state & (length - 1)];
+    }
+    else if (band_limited)
+    {
+        output = polyblep_sample(engine, voice_num, phase);
+    }
+    // Interpolation happens because there are "gaps" that are between the phase
+    // accumulator and the table.
+    else if (interpolate)
+    {
+        // This is how far off we are.  I.e. the error.
+        int32_t distance = scaled & (PHASEACC_MAX - 1);
+        int32_t v1, v2;
+
+        v1 = samples[position];
+        position++;
+        if (position >= length)
+            position -= length;
+        v2 = samples[position];
+
+        // Both weights are scaled by the table length, so this gives the
+        // same result as weighting by the gap between entries.  Bias
+        // negative sums so the shift rounds toward zero like a divide.
+        output = (v1 * (PHASEACC_MAX - distance)) + (v2 * distance);
+        if (output < 0)
+            output += PHASEACC_MAX - 1;
+        output >>= PHASEACC_BITS;
+    }
+    else
+    {
+        output = samples[position];
+    }
+
+    // The envelope, exactly as processADSR() applies it.  Holding phases
+    // have no step and nothing to count down.
+    if (ramp)
+        lanes->envelope_level[voice_num] += lanes->envelope_step[voice_num];
+    envelope = lanes->envelope_level[voice_num] >> (ENVELOPE_BITS - ENVELOPE_GAIN_BITS);
+    if (apply_gain)
+        envelope = (envelope * lanes->gain[voice_num]) >> ENVELOPE_GAIN_BITS;
+    output = (output * envelope) >> VOICE_SHIFT;
+
+    if (ramp && !--lanes->envelope_remaining[voice_num])
+        adsr_phase_done(engine, voice_num);
+
+    return output;
+}
+
+#define VOICE_KERNEL(name, table_length, interpolate, ramp, band_limited, noise, apply_gain) \
+static int32_t name(struct ltc_sound_engine *engine, uint8_t voice_num)         \
+{                                                                               \
+    return voice_render(engine, voice_num, table_length, interpolate,          \
+                        ramp, band_limited, noise, apply_gain);                 \
+}
+
+// The four kernels for one kind of table: with the envelope holding or
+// ramping, at full gain or scaled by the player's.
+#define VOICE_KERNEL_SET(name, length, interpolate, band_limited, noise)        \
+VOICE_KERNEL(name##_hold, length, interpolate, 0, band_limited, noise, 0)       \
+VOICE_KERNEL(name##_ramp, length, interpolate, 1, band_limited, noise, 0)       \
+VOICE_KERNEL(name##_hold_gain, length, interpolate, 0, band_limited, noise, 1)  \
+VOICE_KERNEL(name##_ramp_gain, length, interpolate, 1, band_limited, noise, 1)
+
+// Indexed by [ramp][scaled]
+#define VOICE_KERNEL_SET_ROW(name)                                              \
+    { { name##_hold, name##_hold_gain }, { name##_ramp, name##_ramp_gain } }
+
+// The kernels for one table length, nearest or interpolated.
+#define VOICE_KERNELS(length)                                                   \
+VOICE_KERNEL_SET(voice_##length##_nearest, length, 0, 0, 0)                     \
+VOICE_KERNEL_SET(voice_##length##_lerp, length, 1, 0, 0)
+
+#define VOICE_KERNEL_ROW(length)                                                \
+    { VOICE_KERNEL_SET_ROW(voice_##length##_nearest),                           \
+      VOICE_KERNEL_SET_ROW(voice_##length##_lerp) }
+
+// Length 0 takes tables of any length.
+VOICE_KERNELS(0)
+#if SPECIALIZE_TABLE_LENGTHS
+VOICE_KERNELS(16)
+VOICE_KERNELS(32)
+VOICE_KERNELS(64)
+VOICE_KERNELS(128)
+#endif
+
+// Band-limited voices are rare and slow anyway, so they only get the one
+// length.
+VOICE_KERNEL_SET(voice_polyblep, 0, 1, 1, 0)
+
+// Noise tables are tiny and any power of two long; the length only costs a
+// mask.
+VOICE_KERNEL_SET(voice_noise, 0, 0, 0, 1)
+
+static int32_t voice_silent(struct ltc_sound_engine *engine, uint8_t voice_num)
+{
+    (void)engine;
+    (void)voice_num;
+    return 0;
+}
+
+// Indexed by [table length][interpolate][ramp][scaled], with the table
+// lengths in the order voice_kernel_length() numbers them.
+static const voice_kernel_t voice_kernels[][2][2][2] = {
+    VOICE_KERNEL_ROW(0),
+#if SPECIALIZE_TABLE_LENGTHS
+    VOICE_KERNEL_ROW(16),
+    VOICE_KERNEL_ROW(32),
+    VOICE_KERNEL_ROW(64),
+    VOICE_KERNEL_ROW(128),
+#endif
+};
+
+static const voice_kernel_t polyblep_kernels[2][2] = VOICE_KERNEL_SET_ROW(voice_polyblep);
+static const voice_kernel_t noise_kernels[2][2] = VOICE_KERNEL_SET_ROW(voice_noise);
+
+static uint8_t voice_kernel_length(uint32_t length)
+{
+#if SPECIALIZE_TABLE_LENGTHS
+    switch (length) {
+    case 16:
+        return 1;
+    case 32:
+        return 2;
+    case 64:
+        return 3;
+    case 128:
+        return 4;
+    }
+#else
+    (void)length;
+#endif
+    return 0;
+}
+
+// Point a voice at the kernel for how it's playing now.  Everything the
+// choice depends on is set by note_on() before it starts the attack, by
+// the envelope changing phase, or by its player's gain changing, and all
+// of those come through here.
+static void voice_pick_kernel(struct ltc_sound_engine *engine, uint8_t voice_num)
+{
+    struct ltc_voice *voice = &engine->voices[voice_num];
+    const struct ltc_voice_lanes *lanes = &engine->lanes;
+    int ramp = lanes->envelope_remaining[voice_num] != 0;
+    int scaled = lanes->gain[voice_num] != GAIN_ONE;
+
+    if (voice->adsr_phase == PHASE_OFF)
+        voice->kernel = voice_silent;
+    else if (engine->polyblep_voices & (1UL << voice_num))
+        voice->kernel = polyblep_kernels[ramp][scaled];
+    else if (lanes->noise_taps[voice_num])
+        voice->kernel = noise_kernels[ramp][scaled];
+    else
+        voice->kernel = voice_kernels[voice->kernel_length][lanes->distance_mask[voice_num] != 0][ramp][scaled];
+}
+
+int32_t get_sample(struct ltc_sound_engine *engine, uint8_t voice_num)
+{
+#ifdef CYCLE_STATS
+    struct cycle_context context;
+    uint8_t transitions = engine->cycles.context.transitions;
+    uint32_t start = cycle_now();
+    int32_t output;
+
+    context.phase = engine->voices[voice_num].adsr_phase;
+    output = engine->voices[voice_num].kernel(engine, voice_num);
+
+    context.op = 0;
+    context.ops = 0;
+    context.transitions = engine->cycles.context.transitions - transitions;
+    cycle_stats_add(&engine->cycles.voice, cycles_since(start), 1, &context);
+    return output;
+#else
+    return engine->voices[voice_num].kernel(engine, voice_num);
+#endif
+}
+
+// Nonzero if voice `a` should be cut off before voice `b`.
+static int voice_steal_before(const struct ltc_sound_engine *engine,
+                              uint8_t a_num, uint8_t b_num)
+{
+    const struct ltc_voice *a = &engine->voices[a_num];
+    const struct ltc_voice *b = &engine->voices[b_num];
+
+    switch (engine->steal_policy) {
+    case VOICE_STEAL_QUIETEST:
+        return engine->lanes.envelope_level[a_num] < engine->lanes.envelope_level[b_num];
+
+    case VOICE_STEAL_RELEASED_FIRST:
+        if ((a->adsr_phase == PHASE_RELEASE) != (b->adsr_phase == PHASE_RELEASE))
+            return a->adsr_phase == PHASE_RELEASE;
+        /* Fall through */
+    case VOICE_STEAL_OLDEST:
+    default:
+        return (int32_t)(a->serial - b->serial) < 0;
+    }
+}
+
+// The gain a voice started by channel `channel_num` plays at.  Sound
+// effects are never turned down.
+static inline int32_t channel_gain(const struct ltc_sound_engine *engine, uint8_t channel_num)
+{
+    if (channel_num >= SFX_FIRST_CHANNEL)
+        return GAIN_ONE;
+    return engine->players[channel_num / MAX_CHANNELS].mixed_gain;
+}
+
+// Find a voice for a new note, preferring an idle one and stealing one
+// otherwise.  The voice is detached from whichever channel had it.
+static uint8_t voice_alloc(struct ltc_sound_engine *engine, uint8_t channel_num)
+{
+    struct ltc_voice *voice;
+    uint32_t allowed = UINT32_MAX;
+    uint8_t best = NO_VOICE;
+    uint8_t voice_num;
+
+    // A player's notes stay within its voices, if that leaves it any.
+    if (channel_num < SFX_FIRST_CHANNEL) {
+        uint32_t pool = (engine->voice_count < 32) ? (1UL << engine->voice_count) - 1 : UINT32_MAX;
+
+        allowed = engine->players[channel_num / MAX_CHANNELS].voices;
+        if (!(allowed & pool))
+            allowed = UINT32_MAX;
+    }
+
+    for (voice_num = 0; voice_num < engine->voice_count; voice_num++) {
+        if (!((allowed >> voice_num) & 1))
+            continue;
+        if (engine->voices[voice_num].adsr_phase == PHASE_OFF) {
+            best = voice_num;
+            break;
+        }
+        if ((best == NO_VOICE) || voice_steal_before(engine, voice_num, best))
+            best = voice_num;
+    }
+
+    voice = &engine->voices[best];
+    if ((voice->owner != NO_CHANNEL) && (engine->channels[voice->owner].voice == best))
+        engine->channels[voice->owner].voice = NO_VOICE;
+
+    voice->owner = channel_num;
+    engine->channels[channel_num].voice = best;
+    return best;
+}
+
+// Find the jumps in a band-limited voice's table: places where
+// neighbouring entries are more than half the range apart.  An edge sits
+// at the start of the entry after the jump.
+static void polyblep_start(struct ltc_sound_engine *engine, uint8_t voice_num)
+{
+    struct ltc_voice *voice = &engine->voices[voice_num];
+    const int8_t *samples = voice->instrument->samples;
+    uint32_t length = voice->instrument->length;
+    uint32_t increment = engine->lanes.phase_increment[voice_num];
+    uint32_t entry;
+    int edges = 0;
+
+    voice->edge_height[0] = 0;
+    voice->edge_height[1] = 0;
+    for (entry = 0; (entry < length) && (edges < 2); entry++) {
+        uint32_t next = (entry + 1 < length) ? entry + 1 : 0;
+        int32_t height = samples[next] - samples[entry];
+
+        if ((height > 128) || (height < -128)) {
+            voice->edge_phase[edges] = (next * PHASEACC_MAX) / length;
+            voice->edge_height[edges] = height;
+            edges++;
+        }
+    }
+
+    // A silent note has no edges to smooth.
+    if (!edges || !increment)
+        return;
+    voice->phase_reciprocal = (1UL << 28) / increment;
+    engine->polyblep_voices |= 1UL << voice_num;
+}
+
+// Pick the band-limited level a note should play from: the richest one
+// whose harmonics all stay below half the sample rate, or the last one if
+// none do.  Returns NULL when the instrument's own table is good enough:
+// when everything it can hold fits, or, if PolyBLEP smooths its edges,
+// when the richest level would fit anyway.
+static const struct ltc_wave_level *wave_level(const struct ltc_sound_engine *engine,
+                                               const struct ltc_instrument_slot *instrument,
+                                               uint32_t increment)
+{
+    uint32_t harmonics = instrument->harmonics;
+    uint8_t level;
+
+    if (!engine->mipmaps || !instrument->level_count)
+        return 0;
+    if (engine->polyblep && (instrument->flags & INSTRUMENT_POLYBLEP))
+        harmonics = instrument->levels[0].harmonics;
+    if (increment * harmonics < PHASEACC_MAX / 2)
+        return 0;
+
+    for (level = 0; level < instrument->level_count - 1; level++)
+        if (increment * instrument->levels[level].harmonics < PHASEACC_MAX / 2)
+            break;
+    return &instrument->levels[level];
+}
+
+static void note_on(struct ltc_sound_engine *engine, uint8_t channel_num, uint32_t freq)
+{
+    struct ltc_channel *channel = &engine->channels[channel_num];
+    const struct ltc_instrument_slot *instrument = channel->instrument;
+    struct ltc_voice_lanes *lanes = &engine->lanes;
+    const struct ltc_wave_level *level;
+    struct ltc_voice *voice;
+    uint8_t voice_num;
+
+    // Without an instrument there's nothing to hear.
+    if (!instrument)
+        return;
+
+    // A channel that is still holding its last note retriggers that voice.
+    // Once a note has been released, its tail rings out on its own voice
+    // and the new note gets another one from the pool.
+    if ((channel->voice != NO_VOICE)
+     && (engine->voices[channel->voice].adsr_phase != PHASE_RELEASE))
+        voice_num = channel->voice;
+    else
+        voice_num = voice_alloc(engine, channel_num);
+    voice = &engine->voices[voice_num];
+
+    voice->instrument = instrument;
+    voice->adsr = channel->adsr;
+    voice->serial = ++engine->voice_serial;
+    voice->frequency = freq;
+    lanes->gain[voice_num] = channel_gain(engine, channel_num);
+
+    // calculate the phase accumulator distance
+    // we divide the frequency by the sample rate to give us how much of a cycle occurs
+    // between successive samples... assuming a frequency range of 20Hz-20kHz this would
+    // be on the order of 0.0004 to 0.4, so we multiply it to give us a meaningful range
+    lanes->phase_increment[voice_num] = (freq * PHASEACC_MAX) / engine->sample_rate;
+    lanes->phase_accumulator[voice_num] = 0;
+    lanes->noise_taps[voice_num] = instrument->noise_taps;
+    engine->polyblep_voices &= ~(1UL << voice_num);
+    if (instrument->noise_taps) {
+        // Noise clocks its LFSR at the note's frequency times
+        // 2^noise_shift, so higher notes are brighter, up to once a sample.
+        // Every note starts the register from the same seed, so each hit
+        // of a drum sounds the same.
+        if (freq >= engine->sample_rate >> instrument->noise_shift)
+            lanes->phase_increment[voice_num] = PHASEACC_MAX;
+        else
+            lanes->phase_increment[voice_num] =
+                ((freq << instrument->noise_shift) * PHASEACC_MAX) / engine->sample_rate;
+        lanes->noise_state[voice_num] = 1;
+    }
+    level = wave_level(engine, instrument, lanes->phase_increment[voice_num]);
+    if (level) {
+        // The levels are smooth enough to always interpolate.
+        lanes->samples[voice_num] = level->samples;
+        lanes->length[voice_num] = level->length;
+        lanes->distance_mask[voice_num] = engine->interpolation ? PHASEACC_MAX - 1 : 0;
+        voice->kernel_length = voice_kernel_length(level->length);
+    }
+    else {
+        lanes->samples[voice_num] = instrument->samples;
+        lanes->length[voice_num] = instrument->length;
+        lanes->distance_mask[voice_num] = engine->interpolation ? instrument->distance_mask : 0;
+        voice->kernel_length = instrument->kernel_length;
+
+        if (engine->polyblep && (instrument->flags & INSTRUMENT_POLYBLEP))
+            polyblep_start(engine, voice_num);
+    }
+    ADSR_PHASE(engine, voice_num, PHASE_ATTACK);
+}
+
+static void note_off(struct ltc_sound_engine *engine, uint8_t channel_num)
+{
+    uint8_t voice_num = engine->channels[channel_num].voice;
+
+    if (voice_num == NO_VOICE)
+        return;
+
+    if (engine->voices[voice_num].adsr_phase != PHASE_OFF)
+        ADSR_PHASE(engine, voice_num, PHASE_RELEASE);
+}
+
+#if PREDECODE_PATTERNS
+typedef void (*op_handler_t)(struct ltc_sound_engine *engine, uint8_t channel_num,
+                             const struct ltc_op *op);
+
+#define OP_EFFECT(effect)                                                       \
+static void op_##effect(struct ltc_sound_engine *engine, uint8_t channel_num,   \
+                        const struct ltc_op *op)                                \
+{                                                                               \
+    effect(engine, channel_num, op->arg);                                       \
+}
+
+OP_EFFECT(patternDelay)
+OP_EFFECT(patternJumpAbs)
+OP_EFFECT(setInstrument)
+OP_EFFECT(setAttackLevel)
+OP_EFFECT(setDecayLevel)
+OP_EFFECT(setSustainLevel)
+OP_EFFECT(setMiddleC)
+OP_EFFECT(patternJumpRel)
+OP_EFFECT(patternRepeatCount)
+OP_EFFECT(channelEnd)
+
+static void op_note(struct ltc_sound_engine *engine, uint8_t channel_num,
+                    const struct ltc_op *op)
+{
+    struct ltc_channel *channel = &engine->channels[channel_num];
+
+    // setSong() has already made sure this stays inside note_lut.
+    note_on(engine, channel_num, note_lut[channel->middle_c + (int8_t)op->arg]);
+
+    channel->note_duration = channel_ticks(engine, channel_num, op->value & 0xff);
+    channel->rest_duration = channel_ticks(engine, channel_num, op->value >> 8);
+}
+
+#define OP_VALUE(setter)                                                        \
+static void op_##setter(struct ltc_sound_engine *engine, uint8_t channel_num,   \
+                        const struct ltc_op *op)                                \
+{                                                                               \
+    setter(engine, channel_num, op->value);                                     \
+}
+
+OP_VALUE(setGlobalSpeed)
+OP_VALUE(setAttackTime)
+OP_VALUE(setDecayTime)
+OP_VALUE(setReleaseTime)
+
+static const op_handler_t op_handlers[OP_HANDLER_COUNT] = {
+    op_note,
+    op_patternDelay,
+    op_patternJumpAbs,
+    op_setInstrument,
+    op_setAttackLevel,
+    op_setDecayLevel,
+    op_setSustainLevel,
+    op_setMiddleC,
+    op_patternJumpRel,
+    op_patternRepeatCount,
+    op_channelEnd,
+    op_setGlobalSpeed,
+    op_setAttackTime,
+    op_setDecayTime,
+    op_setReleaseTime,
+};
+#endif /* PREDECODE_PATTERNS */
+
+// Run the next op on `channel_num`.
+static void channel_run_op(struct ltc_sound_engine *engine, uint8_t channel_num)
+{
+    struct ltc_channel *channel = &engine->channels[channel_num];
+
+#if PREDECODE_PATTERNS
+    if (channel->ops) {
+        const struct ltc_op *op = &channel->ops[channel->pattern_offset];
+        CYCLE_NOTE_OP(engine, channel->pattern[channel->pattern_offset]);
+        channel->pattern_offset++;
+        op_handlers[op->handler](engine, channel_num, op);
+        return;
+    }
+#endif
+#if RAW_PATTERNS
+    uint16_t op = next_pattern_word(engine, channel_num);
+    CYCLE_NOTE_OP(engine, op);
+    if ((op & 0xf000) == 0x8000) {
+        uint32_t effect_num = (op >> 8) & 0x7f;
+        if (effect_num >= ARRAY_SIZE(effect_lut)) {
+            panic("effect_num out of range");
+        }
+        effect_lut[effect_num](engine, channel_num, op & 0xff);
+    }
+    else if ((op & 0xf000) == 0x9000) {
+        setGlobalSpeed(engine, channel_num, op & 0xfff);
+    }
+    else if ((op & 0xf000) == 0xa000) {
+        setAttackTime(engine, channel_num, op & 0xfff);
+    }
+    else if ((op & 0xf000) == 0xb000) {
+        setDecayTime(engine, channel_num, op & 0xfff);
+    }
+    else if ((op & 0xf000) == 0xc000) {
+        setReleaseTime(engine, channel_num, op & 0xfff);
+    }
+    else {
+        uint32_t note_duration = (op >> 10) & 0x1f;
+        uint32_t rest_duration = (op >> 5) & 0x1f;
+        uint32_t note_index = ((op >> 0) & 0x1f) - 16;
+        note_index = channel->middle_c + note_index;
+
+        if (note_index >= ARRAY_SIZE(note_lut))
+            panic("note_index out of range");
+        note_on(engine, channel_num, note_lut[note_index]);
+
+        channel->note_duration = channel_ticks(engine, channel_num, note_duration);
+        channel->rest_duration = channel_ticks(engine, channel_num, rest_duration);
+    }
+#endif
+}
+
+// Ops take no time: the next one runs on the sample the last note or rest
+// ends on, so songs don't fall behind their tempo by a sample per op.  A
+// pattern of nothing but effects would never let go, so no more than this
+// many run on a channel per sample, and the rest wait for the next.
+#define OPS_PER_STEP 16
+
+static void play_routine_step(struct ltc_sound_engine *engine) {
+    int channel_num;
+    for (channel_num = 0; channel_num < CHANNEL_SLOTS; channel_num++) {
+        struct ltc_channel *channel = &engine->channels[channel_num];
+        int ops;
+
+        if (!channel->pattern)
+            continue;
+        if (channel->note_duration) {
+            channel->note_duration--;
+            if (!channel->note_duration)
+                note_off(engine, channel_num);
+        }
+        else if (channel->rest_duration) {
+            channel->rest_duration--;
+        }
+
+        for (ops = 0; (ops < OPS_PER_STEP) && channel->pattern && !channel->note_duration &&
+                      !channel->rest_duration; ops++)
+            channel_run_op(engine, channel_num);
+    }
+}
+
+// The sample being played right now: the last one rendered, less whatever
+// is still waiting in the FIFO on the device.
+static inline uint32_t engine_output_sample(const struct ltc_sound_engine *engine)
+{
+#ifdef DESKTOP
+    return index_load(&engine->sample_count);
+#else
+    return engine->fifo.played;
+#endif
+}
+
+#if SFX_CHANNELS
+// Check that `sfx` is fit to be passed to trigger_sfx(), once, ahead of
+// time, so that triggering it is quick.  Sound effects are songs with one
+// channel that run on their own channel.  They share the song's speed, so
+// they shouldn't set it.  Their instruments are only checked against
+// INSTRUMENT_SLOTS, since this doesn't know the engine; notes on an empty
+// slot are silent.  Returns 0, or -1 with `error` filled in.
+int sfx_check(const struct ltc_song *sfx, struct ltc_song_error *error)
+{
+    if (sfx->channel_count != 1)
+        return song_error(error, "sound effects have one channel", 0, 0);
+    if (song_streamed(sfx))
+        return song_error(error, "sound effects can't be streamed", 0, 0);
+    return song_decode(0, sfx, 0, 0, error);
+}
+
+static int sfx_push(struct ltc_sound_engine *engine, const struct ltc_song *sfx,
+                    uint8_t priority, uint32_t start, uint8_t now)
+{
+    struct ltc_sfx_queue *queue = &engine->sfx_queue;
+    uint8_t head = queue->head;
+    struct ltc_sfx_trigger *trigger;
+
+    if ((uint8_t)(head - index_load(&queue->tail)) >= SFX_QUEUE_DEPTH) {
+        queue->dropped = queue->dropped + 1;
+        return -1;
+    }
+
+    trigger = &queue->triggers[head & (SFX_QUEUE_DEPTH - 1)];
+    trigger->sfx = sfx;
+    trigger->start = start;
+    trigger->triggered = engine_output_sample(engine);
+    trigger->priority = priority;
+    trigger->now = now;
+    compiler_barrier();
+    index_store(&queue->head, head + 1);
+    return 0;
+}
+
+// Start `sfx`, which has passed sfx_check(), as soon as possible: on the
+// next sample rendered.  If every sound effect channel is busy, it replaces
+// the lowest priority effect playing, as long as that isn't higher than
+// `priority`.  May be called from loop() or from an interrupt, as long as
+// only one of them calls it.  Returns 0, or -1 if the queue is full.
+int trigger_sfx(struct ltc_sound_engine *engine, const struct ltc_song *sfx, uint8_t priority)
+{
+    return sfx_push(engine, sfx, priority, 0, 1);
+}
+
+// The same, but start on the sample numbered `sample`, counting from
+// engine_init().  A sample that has already been rendered by the time the
+// trigger is picked up starts the effect at once.
+int trigger_sfx_at(struct ltc_sound_engine *engine, const struct ltc_song *sfx,
+                   uint8_t priority, uint32_t sample)
+{
+    return sfx_push(engine, sfx, priority, sample, 0);
+}
+
+static void sfx_start(struct ltc_sound_engine *engine, const struct ltc_sfx_trigger *trigger)
+{
+    struct ltc_sfx_stats *stats = &engine->sfx_stats;
+    struct ltc_channel *channel;
+    uint32_t latency;
+    int slot, best = -1;
+
+    // Take a free channel, or the lowest priority one we outrank.
+    for (slot = 0; slot < SFX_CHANNELS; slot++) {
+        if (!engine->channels[SFX_FIRST_CHANNEL + slot].pattern) {
+            best = slot;
+            break;
+        }
+        if ((engine->sfx_priority[slot] <= trigger->priority) &&
+            ((best < 0) || (engine->sfx_priority[slot] < engine->sfx_priority[best])))
+            best = slot;
+    }
+    if (best < 0) {
+        stats->refused++;
+        return;
+    }
+
+    note_off(engine, SFX_FIRST_CHANNEL + best);
+    channel = &engine->channels[SFX_FIRST_CHANNEL + best];
+    memset(channel, 0, sizeof(*channel));
+    channel->song = trigger->sfx;
+    channel_jump(engine, SFX_FIRST_CHANNEL + best, 0);
+    channel->adsr.sustain_level = 100;
+    channel->middle_c = DEFAULT_MIDDLE_C;
+    channel->voice = NO_VOICE;
+    engine->sfx_priority[best] = trigger->priority;
+
+    latency = engine->sample_count - trigger->triggered;
+    if (!stats->started || (latency < stats->latency_min))
+        stats->latency_min = latency;
+    if (latency > stats->latency_max)
+        stats->latency_max = latency;
+    stats->latency_last = latency;
+    stats->latency_total += latency;
+    stats->started++;
+}
+
+// Pick up new triggers and start any that are due on the next sample.
+// Returns how many samples can be rendered before the next one is due.
+static uint32_t sfx_poll(struct ltc_sound_engine *engine)
+{
+    struct ltc_sfx_queue *queue = &engine->sfx_queue;
+    uint32_t now = engine->sample_count, wait = UINT32_MAX;
+    uint8_t tail = queue->tail, head = index_load(&queue->head);
+    int i;
+
+    if ((tail == head) && !engine->sfx_pending_count)
+        return wait;
+
+    while ((tail != head) && (engine->sfx_pending_count < SFX_QUEUE_DEPTH)) {
+        compiler_barrier();
+        engine->sfx_pending[engine->sfx_pending_count++] = queue->triggers[tail & (SFX_QUEUE_DEPTH - 1)];
+        tail++;
+    }
+    compiler_barrier();
+    index_store(&queue->tail, tail);
+
+    for (i = 0; i < engine->sfx_pending_count; ) {
+        const struct ltc_sfx_trigger *trigger = &engine->sfx_pending[i];
+        int32_t until = (int32_t)(trigger->start - now);
+
+        if (trigger->now || (until <= 0)) {
+            if (!trigger->now && (until < 0))
+                engine->sfx_stats.late++;
+            sfx_start(engine, trigger);
+            engine->sfx_pending[i] = engine->sfx_pending[--engine->sfx_pending_count];
+            continue;
+        }
+        if ((uint32_t)until < wait)
+            wait = until;
+        i++;
+    }
+    return wait;
+}
+#endif /* SFX_CHANNELS */
+
+// Stop player `player_num`'s song.  Its notes are released and ring out.
+static void player_stop(struct ltc_sound_engine *engine, uint8_t player_num)
+{
+    struct ltc_player *player = &engine->players[player_num];
+    int channel_num;
+
+    for (channel_num = player_num * MAX_CHANNELS;
+         channel_num < (player_num + 1) * MAX_CHANNELS; channel_num++) {
+        note_off(engine, channel_num);
+        engine->channels[channel_num].pattern = 0;
+    }
+    player->song = 0;
+    player->channel_count = 0;
+    player->starting = 0;
+    player->fading = 0;
+}
+
+// Start player `player_num`'s song, which player_load() has accepted, from
+// the top.
+static void player_start(struct ltc_sound_engine *engine, uint8_t player_num)
+{
+    struct ltc_player *player = &engine->players[player_num];
+    const struct ltc_song *song = player->song;
+    int channel_num;
+
+    if (song->speed)
+        player->tick_length = song_tick_length(engine, song->speed);
+
+    for (channel_num = 0; channel_num < MAX_CHANNELS; channel_num++) {
+        struct ltc_channel *channel = &engine->channels[player_num * MAX_CHANNELS + channel_num];
+
+        memset(channel, 0, sizeof(*channel));
+        channel->voice = NO_VOICE;
+        channel->player = player_num;
+#if SONG_STREAMING
+        memset(&engine->cache[player_num * MAX_CHANNELS + channel_num], 0,
+               sizeof(engine->cache[0]));
+#endif
+        if (channel_num >= player->channel_count)
+            continue;
+        channel->song = song;
+        channel_jump(engine, player_num * MAX_CHANNELS + channel_num, channel_num);
+        channel->adsr.sustain_level = 100;
+        channel->middle_c = DEFAULT_MIDDLE_C;
+    }
+
+#if SONG_STREAMING
+    // Read each channel's start now, rather than on its first sample.
+    if (song->source)
+        song_prefetch(engine);
+#endif
+}
+
+// Play `song` from the top on player `player_num`, in place of whatever
+// it was playing, at the player's current gain.  Other players carry on.
+// A song that fails song_decode() isn't played at all; this returns -1,
+// engine->song_error says why, and the player carries on as it was.
+int player_set_song(struct ltc_sound_engine *engine, uint8_t player_num,
+                    const struct ltc_song *song)
+{
+    if (song_decode(engine, song, 0, 0, &engine->song_error))
+        return -1;
+
+    player_stop(engine, player_num);
+    if (player_load(engine, player_num, song))
+        return -1;
+    player_start(engine, player_num);
+    return 0;
+}
+
+// Start playing `song` from the top on player 0, at full gain, and stop
+// every other player and sound effect.  A refused song stops nothing.
+int setSong(struct ltc_sound_engine *engine, const struct ltc_song *song) {
+    int player_num;
+
+    if (song_decode(engine, song, 0, 0, &engine->song_error))
+        return -1;
+
+    for (player_num = 0; player_num < SONG_PLAYERS; player_num++) {
+        struct ltc_player *player = &engine->players[player_num];
+
+        player->song = 0;
+        player->channel_count = 0;
+        player->starting = 0;
+        player->fading = 0;
+        player->gain = GAIN_ONE;
+    }
+    reset_channels(engine);
+    reset_voices(engine);
+#if SONG_STREAMING
+    memset(engine->cache, 0, sizeof(engine->cache));
+    engine->cache_misses = 0;
+    engine->cache_fills = 0;
+#endif
+
+    if (player_load(engine, 0, song))
+        return -1;
+    player_start(engine, 0);
+    return 0;
+}
+
+static void player_fade_from(struct ltc_player *player, uint8_t percent,
+                             uint32_t start_sample, uint32_t length, uint8_t stop)
+{
+    player->fade_to = GAIN_LEVEL(percent);
+    player->fade_start = start_sample;
+    player->fade_length = length;
+    player->fade_stop = stop;
+    player->fading = 1;
+}
+
+// Set player `player_num`'s gain to `percent` of full, from the next
+// sample on.
+void player_set_gain(struct ltc_sound_engine *engine, uint8_t player_num, uint8_t percent)
+{
+    struct ltc_player *player = &engine->players[player_num];
+
+    player->fading = 0;
+    player->gain = GAIN_LEVEL(percent);
+}
+
+// Fade player `player_num` from wherever it is on sample `start_sample` to
+// `percent` of full, in a straight line over `length` samples.  Sample
+// numbers count from engine_init(), like trigger_sfx_at()'s.
+void player_fade(struct ltc_sound_engine *engine, uint8_t player_num, uint8_t percent,
+                 uint32_t start_sample, uint32_t length)
+{
+    player_fade_from(&engine->players[player_num], percent, start_sample, length, 0);
+}
+
+// Start `song` on sample `start_sample`, fading it in from silence over
+// `length` samples while every other player fades out and then stops.
+// The song goes on an idle player, or else the quietest one.  Returns that
+// player, or -1 if the song is refused, as setSong() would, in which case
+// every player carries on as it was.
+int crossfade_to(struct ltc_sound_engine *engine, const struct ltc_song *song,
+                 uint32_t start_sample, uint32_t length)
+{
+    struct ltc_player *player;
+    int player_num, best = -1;
+
+    // Check the song before taking a player for it.  Loading decodes into
+    // the player, so a song refused halfway through would have wrecked
+    // whatever it was playing.
+    if (song_decode(engine, song, 0, 0, &engine->song_error))
+        return -1;
+
+    for (player_num = 0; player_num < SONG_PLAYERS; player_num++) {
+        player = &engine->players[player_num];
+        if (!player->song) {
+            best = player_num;
+            break;
+        }
+        if ((best < 0) || (player->gain < engine->players[best].gain))
+            best = player_num;
+    }
+
+    player_stop(engine, best);
+    if (player_load(engine, best, song))
+        return -1;
+
+    for (player_num = 0; player_num < SONG_PLAYERS; player_num++)
+        if ((player_num != best) && engine->players[player_num].song)
+            player_fade_from(&engine->players[player_num], 0, start_sample, length, 1);
+
+    player = &engine->players[best];
+    player->gain = 0;
+    player->starting = 1;
+    player->start = start_sample;
+    player_fade_from(player, 100, start_sample, length, 0);
+    return best;
+}
+
+// Limit player `player_num`'s notes to voices `first` to `first + count -
+// 1`, so that they can't steal voices another player's notes are using.
+// Sound effects may still take any voice.
+void player_set_voices(struct ltc_sound_engine *engine, uint8_t player_num,
+                       uint8_t first, uint8_t count)
+{
+    uint32_t voices = 0;
+
+    while (count-- && (first < 32))
+        voices |= 1UL << first++;
+    engine->players[player_num].voices = voices;
+}
+
+// Whether player `player_num` is turned down while sound effects play.
+void player_set_ducked(struct ltc_sound_engine *engine, uint8_t player_num, uint8_t ducked)
+{
+    engine->players[player_num].ducked = ducked;
+}
+
+// Turn ducked players down to `percent` of their gain while any sound
+// effect plays, taking `attack` samples to get there and `release` samples
+// to come back up afterwards.
+void engine_set_ducking(struct ltc_sound_engine *engine, uint8_t percent,
+                        uint32_t attack, uint32_t release)
+{
+    int32_t depth;
+
+    engine->duck_level = GAIN_LEVEL(percent);
+    depth = GAIN_ONE - engine->duck_level;
+    if (depth < 0)
+        depth = -depth;
+    engine->duck_attack = attack ? depth / (int32_t)attack : GAIN_ONE;
+    engine->duck_release = release ? depth / (int32_t)release : GAIN_ONE;
+    if (!engine->duck_attack)
+        engine->duck_attack = 1;
+    if (!engine->duck_release)
+        engine->duck_release = 1;
+}
+
+// Move `gain` towards `target` by `step` per sample for `elapsed` samples.
+static int32_t gain_ramp(int32_t gain, int32_t target, int32_t step, uint32_t elapsed)
+{
+    // A full swing never takes more than GAIN_ONE samples.
+    int32_t change = step * (int32_t)(elapsed < GAIN_ONE ? elapsed : GAIN_ONE);
+
+    if (gain < target)
+        return (target - gain <= change) ? target : gain + change;
+    return (gain - target <= change) ? target : gain - change;
+}
+
+// Start songs and move fades and ducking on to the sample about to be
+// rendered, and hand any gain that changed to the voices.  Returns how many
+// samples can be rendered before a gain next needs to move.  Gains move
+// every GAIN_RUN samples while they're ramping.
+static uint32_t players_update(struct ltc_sound_engine *engine)
+{
+    uint32_t now = engine->sample_count, wait = UINT32_MAX;
+    int32_t duck_target = GAIN_ONE;
+    int changed = 0;
+    int player_num;
+#if SFX_CHANNELS
+    int channel_num;
+
+    for (channel_num = SFX_FIRST_CHANNEL; channel_num < CHANNEL_SLOTS; channel_num++)
+        if (engine->channels[channel_num].pattern)
+            duck_target = engine->duck_level;
+#endif
+    if (engine->duck_gain != duck_target) {
+        int32_t step = (duck_target < engine->duck_gain) ? engine->duck_attack : engine->duck_release;
+
+        engine->duck_gain = gain_ramp(engine->duck_gain, duck_target, step,
+                                      now - engine->gain_sample);
+        if (engine->duck_gain != duck_target)
+            wait = GAIN_RUN;
+    }
+    engine->gain_sample = now;
+
+    for (player_num = 0; player_num < SONG_PLAYERS; player_num++) {
+        struct ltc_player *player = &engine->players[player_num];
+        int32_t mixed_gain;
+
+        if (player->starting) {
+            int32_t until = (int32_t)(player->start - now);
+
+            if (until <= 0) {
+                player->starting = 0;
+                player_start(engine, player_num);
+            }
+            else if ((uint32_t)until < wait)
+                wait = until;
+        }
+
+        if (player->fading) {
+            int32_t since = (int32_t)(now - player->fade_start);
+
+            if (since < 0) {
+                if ((uint32_t)-since < wait)
+                    wait = -since;
+            }
+            else {
+                if (player->fading == 1) {
+                    player->fade_from = player->gain;
+                    player->fading = 2;
+                }
+                if ((uint32_t)since >= player->fade_length) {
+                    player->gain = player->fade_to;
+                    player->fading = 0;
+                    if (player->fade_stop)
+                        player_stop(engine, player_num);
+                }
+                else {
+                    player->gain = player->fade_from +
+                        (int32_t)(((int64_t)(player->fade_to - player->fade_from) * since)
+                                  / player->fade_length);
+                    if (wait > GAIN_RUN)
+                        wait = GAIN_RUN;
+                    if (player->fade_length - since < wait)
+                        wait = player->fade_length - since;
+                }
+            }
+        }
+
+        mixed_gain = player->gain;
+        if (player->ducked)
+            mixed_gain = (mixed_gain * engine->duck_gain) >> ENVELOPE_GAIN_BITS;
+        if (mixed_gain != player->mixed_gain) {
+            player->mixed_gain = mixed_gain;
+            changed = 1;
+        }
+    }
+
+    if (changed) {
+        uint8_t voice_num;
+
+        for (voice_num = 0; voice_num < engine->voice_count; voice_num++) {
+            engine->lanes.gain[voice_num] = channel_gain(engine, engine->voices[voice_num].owner);
+            voice_pick_kernel(engine, voice_num);
+        }
+    }
+    return wait;
+}
+
+// How many samples can go by before any channel does more than count down
+// its note or rest.  Those samples don't need play_routine_step() at all.
+static uint32_t sequencer_idle(const struct ltc_sound_engine *engine)
+{
+    uint32_t idle = UINT32_MAX;
+    int channel_num;
+
+    for (channel_num = 0; channel_num < CHANNEL_SLOTS; channel_num++) {
+        const struct ltc_channel *channel = &engine->channels[channel_num];
+        uint32_t wait;
+
+        if (!channel->pattern)
+            continue;
+
+        // The note's last sample releases it, and the next op runs on the
+        // rest's last sample, or at once if ops are still waiting.
+        if (channel->note_duration)
+            wait = channel->note_duration - 1;
+        else if (channel->rest_duration)
+            wait = channel->rest_duration - 1;
+        else
+            wait = 0;
+        if (wait < idle)
+            idle = wait;
+    }
+    return idle;
+}
+
+// Do what `samples` calls to play_routine_step() would, when that's no more
+// than sequencer_idle().
+static void sequencer_skip(struct ltc_sound_engine *engine, uint32_t samples)
+{
+    int channel_num;
+
+    for (channel_num = 0; channel_num < CHANNEL_SLOTS; channel_num++) {
+        struct ltc_channel *channel = &engine->channels[channel_num];
+
+        if (!channel->pattern)
+            continue;
+        if (channel->note_duration)
+            channel->note_duration -= samples;
+        else
+            channel->rest_duration -= samples;
+    }
+}
+
+// Nonzero once every channel has reached CHANNEL_END and every voice is off.
+int song_finished(const struct ltc_sound_engine *engine)
+{
+    int channel_num;
+
+    if (engine->active_voices)
+        return 0;
+    for (channel_num = 0; channel_num < CHANNEL_SLOTS; channel_num++)
+        if (engine->channels[channel_num].pattern)
+            return 0;
+    return 1;
+}
+
+// Past the knee, soft_clip() bends a sample over so that it flattens out at
+// full scale, 2 << BUS_CLIP_RANGE_BITS past the knee.
+#define BUS_CLIP_KNEE 24576
+#define BUS_CLIP_RANGE_BITS 13
+
+// y = x - (x - knee)^2 / (4 * range), which leaves the knee with a slope
+// of 1 and reaches full scale with a slope of 0.  No divide, one multiply.
+static inline int32_t soft_clip(int32_t sample)
+{
+    int32_t over;
+
+    if (sample > BUS_CLIP_KNEE) {
+        over = sample - BUS_CLIP_KNEE;
+        if (over >= (2L << BUS_CLIP_RANGE_BITS))
+            return INT16_MAX;
+        sample -= (over * over) >> (BUS_CLIP_RANGE_BITS + 2);
+        return (sample > INT16_MAX) ? INT16_MAX : sample;
+    }
+    if (sample < -BUS_CLIP_KNEE) {
+        over = -BUS_CLIP_KNEE - sample;
+        if (over >= (2L << BUS_CLIP_RANGE_BITS))
+            return INT16_MIN;
+        sample += (over * over) >> (BUS_CLIP_RANGE_BITS + 2);
+        return (sample < INT16_MIN) ? INT16_MIN : sample;
+    }
+    return sample;
+}
+
+// Turn `frames` mixed samples into 16-bit output.
+static void bus_mix(const struct ltc_sound_engine *engine, const int32_t *mix,
+                    int16_t *out, size_t frames)
+{
+    int32_t gain = engine->master_gain;
+    size_t i;
+
+    for (i = 0; i < frames; i++) {
+        int32_t sample = mix[i];
+
+        // A loud mix times a master gain over 100% can pass 32 bits.
+        if (gain != GAIN_ONE)
+            sample = (int32_t)(((int64_t)sample * gain) >> ENVELOPE_GAIN_BITS);
+
+        if (engine->soft_clip)
+            sample = soft_clip(sample);
+        else if (sample > INT16_MAX)
+            sample = INT16_MAX;
+        else if (sample < INT16_MIN)
+            sample = INT16_MIN;
+        out[i] = sample;
+    }
+}
+
+// Convert a 16-bit sample, already brought down to 8 bits, into a PWM
+// compare value.  The PWM counter runs from 0 to 255, and 0 and 255 are
+// avoided to keep both channels toggling.
+static inline uint8_t sample_to_pwm(int32_t sample)
+{
+    int32_t scaled_sample = sample + 129;
+    if (scaled_sample > 255)
+        scaled_sample = 255;
+    if (scaled_sample < 1)
+        scaled_sample = 1;
+    return scaled_sample;
+}
+
+// Bring `frames` samples from render_block() down to PWM compare values.
+// With dither on, triangular noise one PWM step either way is added before
+// rounding, and each sample's rounding error is taken off the next.  That
+// keeps quiet passages from turning into steps, and pushes the noise left
+// behind up towards half the sample rate.
+static void bus_to_pwm(struct ltc_sound_engine *engine, const int16_t *in,
+                       uint8_t *out, size_t frames)
+{
+    uint32_t seed = engine->dither_seed;
+    int32_t error = engine->dither_error;
+    size_t i;
+#ifdef CYCLE_STATS
+    uint32_t start = cycle_now();
+#endif
+
+    if (!engine->dither) {
+        for (i = 0; i < frames; i++)
+            out[i] = sample_to_pwm(in[i] >> BUS_EXTRA_BITS);
+    }
+    else {
+        for (i = 0; i < frames; i++) {
+            int32_t wanted = in[i] - error;
+            int32_t noise, level;
+
+            // xorshift32
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            noise = (int32_t)(seed & 0xff) - (int32_t)((seed >> 8) & 0xff);
+
+            level = (wanted + noise + (1 << (BUS_EXTRA_BITS - 1))) >> BUS_EXTRA_BITS;
+            error = level * (1 << BUS_EXTRA_BITS) - wanted;
+            out[i] = sample_to_pwm(level);
+        }
+        engine->dither_seed = seed;
+        engine->dither_error = error;
+    }
+#ifdef CYCLE_STATS
+    if (frames)
+        cycle_stats_add(&engine->cycles.dither, cycles_since(start), frames, &engine->cycles.context);
+#endif
+}
+
+// Set the mix bus's master gain to `percent` of full.  Gains over 100%
+// make room to bring up quiet songs, and lean on the soft clipper.
+void engine_set_volume(struct ltc_sound_engine *engine, uint8_t percent)
+{
+    engine->master_gain = GAIN_LEVEL(percent);
+}
+
+// Resampling the mix bus's output up to another rate, such as 44.1 or
+// 48 kHz for a desktop sound card.  Each output sample is interpolated
+// between two adjacent rows of resample_taps, a windowed sinc made by
+// gen-tables.py, which takes 2 * RESAMPLE_TAPS multiplies.  Positions are
+// kept as 32-bit fractions of an input sample, so the output doesn't drift
+// from the input by more than a sample in a day.
+struct ltc_resampler {
+    // Input samples per output sample, as a fraction of 2^32, or 0 to copy
+    uint32_t step;
+
+    // How far past the newest input sample the next output sample is
+    uint32_t position;
+
+    // Output samples one input sample can make, at most
+    uint32_t ratio;
+
+    // The last RESAMPLE_TAPS input samples, oldest first from `head`,
+    // twice over so the window never wraps
+    uint8_t head;
+    int16_t history[2 * RESAMPLE_TAPS];
+};
+
+// Set `resampler` up to go from `in_rate` up to `out_rate`.  Going down
+// isn't supported, since the filter is cut off for the input.  Returns -1
+// if `out_rate` is lower than `in_rate`.
+int resampler_init(struct ltc_resampler *resampler, uint32_t in_rate, uint32_t out_rate)
+{
+    if (!in_rate || (out_rate < in_rate))
+        return -1;
+    memset(resampler, 0, sizeof(*resampler));
+    if (out_rate != in_rate)
+        resampler->step = ((uint64_t)in_rate << 32) / out_rate;
+    resampler->ratio = (out_rate + in_rate - 1) / in_rate;
+    return 0;
+}
+
+// One output sample `position` of the way through the window's middle
+// input sample, for the top RESAMPLE_PHASE_BITS bits, interpolated between
+// two rows of taps for the next 14.
+static ALWAYS_INLINE int16_t resample_one(const int16_t *window, uint32_t position)
+{
+    const int16_t *taps = resample_taps[position >> (32 - RESAMPLE_PHASE_BITS)];
+    int32_t weight = (position >> (32 - RESAMPLE_PHASE_BITS - 14)) & 0x3fff;
+    int32_t a = 0, b = 0, out;
+    int tap;
+
+    for (tap = 0; tap < RESAMPLE_TAPS; tap++) {
+        a += window[tap] * taps[tap];
+        b += window[tap] * taps[tap + RESAMPLE_TAPS];
+    }
+    a >>= 15;
+    b >>= 15;
+    out = a + (((b - a) * weight) >> 14);
+    if (out > INT16_MAX)
+        out = INT16_MAX;
+    if (out < INT16_MIN)
+        out = INT16_MIN;
+    return out;
+}
+
+// Resample `count` samples from `in` into `out`, which has room for
+// `count * resampler->ratio`.  The output lags the input by
+// RESAMPLE_TAPS / 2 input samples.  Returns how many samples it made.
+uint32_t resample_block(struct ltc_resampler *resampler, const int16_t *in, uint32_t count,
+                        int16_t *out)
+{
+    uint32_t position = resampler->position, made = 0, i;
+    uint8_t head = resampler->head;
+
+    if (!resampler->step) {
+        memcpy(out, in, count * sizeof(*in));
+        return count;
+    }
+
+    for (i = 0; i < count; i++) {
+        const int16_t *window;
+
+        resampler->history[head] = in[i];
+        resampler->history[head + RESAMPLE_TAPS] = in[i];
+        head = (head + 1) % RESAMPLE_TAPS;
+        window = &resampler->history[head];
+
+        // Going up, every input sample makes at least one output sample.
+        do {
+            out[made++] = resample_one(window, position);
+            position += resampler->step;
+        } while (position >= resampler->step);
+    }
+
+    resampler->position = position;
+    resampler->head = head;
+    return made;
+}
+
+// Add `frames` samples from every active voice into `mix`.  This is the
+// reference mixer that the firmware uses; the SIMD mixers below must match
+// it bit for bit.
+void mix_voices_scalar(struct ltc_sound_engine *engine, int32_t *mix, size_t frames)
+{
+    size_t frame;
+    uint8_t voice_num;
+
+    for (frame = 0; frame < frames; frame++) {
+        int32_t sample = 0;
+
+        // Idle voices cost nothing beyond this check.
+        for (voice_num = 0; voice_num < engine->voice_count; voice_num++)
+            if (engine->active_voices & (1UL << voice_num))
+                sample += get_sample(engine, voice_num);
+
+        mix[frame] += sample;
+    }
+}
+
+// Instrumented builds time get_sample(), which only the scalar mixer uses.
+#if defined(CYCLE_STATS) && !defined(NO_SIMD)
+#define NO_SIMD
+#endif
+
+#if defined(DESKTOP) && !defined(NO_SIMD) && (defined(__SSE2__) || defined(__AVX2__))
+#include <immintrin.h>
+
+// Fetch each lane's table entry and the one after it, packed as a pair of
+// 16-bit values ready for a multiply-add against the interpolation weights.
+static inline void fetch_sample_pairs(const struct ltc_voice_lanes *lanes,
+                                      int group, int count,
+                                      const uint32_t *position, uint32_t *pairs)
+{
+    int lane;
+
+    for (lane = 0; lane < count; lane++) {
+        const int8_t *samples = lanes->samples[group + lane];
+        uint32_t next = position[lane] + 1;
+
+        next &= -(uint32_t)(next < lanes->length[group + lane]);
+        pairs[lane] = (uint16_t)(int16_t)samples[position[lane]]
+                    | ((uint32_t)(uint16_t)(int16_t)samples[next] << 16);
+    }
+}
+
+// Envelope phases that ran out are finished one voice at a time, exactly as
+// processADSR() would have.
+static inline void finish_phases(struct ltc_sound_engine *engine, int group, int ended)
+{
+    while (ended) {
+        int lane = __builtin_ctz(ended);
+        adsr_phase_done(engine, group + lane);
+        ended &= ended - 1;
+    }
+}
+#endif
+
+#if defined(DESKTOP) && !defined(NO_SIMD) && defined(__SSE2__) && !defined(__AVX2__)
+// SSE2 has no 32-bit multiply that keeps the low half, so build one from
+// two 32x32->64 multiplies.
+static inline __m128i mullo_epi32_sse2(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+// Mix four voices at a time.  Each group's state stays in registers for the
+// whole run of frames.  Every step does the same integer operations as
+// get_sample() and processADSR(), so the output is identical.
+static void mix_voices_sse2(struct ltc_sound_engine *engine, int32_t *mix, size_t frames)
+{
+    struct ltc_voice_lanes *lanes = &engine->lanes;
+    const __m128i phase_mask = _mm_set1_epi32(PHASEACC_MAX - 1);
+    const __m128i full_weight = _mm_set1_epi32(PHASEACC_MAX);
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i zero = _mm_setzero_si128();
+    size_t frame;
+    int group;
+
+    for (group = 0; group < engine->voice_count; group += 4) {
+        __m128i phase, increment, length, distance_mask, level, step, remaining, gain;
+        __m128i noise_state, noise_taps, noise_lanes, noise_mask;
+        int scale, noise;
+
+        if (!((engine->active_voices >> group) & 0xf))
+            continue;
+
+#define LOAD_LANES(field) _mm_loadu_si128((const __m128i *)&lanes->field[group])
+#define STORE_LANES(field, v) _mm_storeu_si128((__m128i *)&lanes->field[group], v)
+        phase = LOAD_LANES(phase_accumulator);
+        increment = LOAD_LANES(phase_increment);
+        length = LOAD_LANES(length);
+        distance_mask = LOAD_LANES(distance_mask);
+        level = LOAD_LANES(envelope_level);
+        step = LOAD_LANES(envelope_step);
+        remaining = LOAD_LANES(envelope_remaining);
+        gain = LOAD_LANES(gain);
+        scale = _mm_movemask_epi8(_mm_cmpeq_epi32(gain, _mm_set1_epi32(GAIN_ONE))) != 0xffff;
+        noise_state = LOAD_LANES(noise_state);
+        noise_taps = LOAD_LANES(noise_taps);
+        noise_lanes = _mm_cmpeq_epi32(noise_taps, zero);
+        noise = _mm_movemask_epi8(noise_lanes) != 0xffff;
+        noise_lanes = _mm_andnot_si128(noise_lanes, _mm_set1_epi32(-1));
+        noise_mask = _mm_sub_epi32(length, one);
+
+        for (frame = 0; frame < frames; frame++) {
+            uint32_t position[4], pairs[4];
+            __m128i stepped, scaled, distance, weights, output, envelope, counting, ended;
+
+            stepped = _mm_add_epi32(phase, increment);
+            phase = _mm_and_si128(stepped, phase_mask);
+            scaled = mullo_epi32_sse2(phase, length);
+            distance = _mm_and_si128(scaled, distance_mask);
+            scaled = _mm_srli_epi32(scaled, PHASEACC_BITS);
+            if (noise) {
+                // Step the noise lanes' LFSRs where their phase wrapped and
+                // read their tables from the low bits, as voice_render()
+                // does.  Noise never interpolates, so `distance` is 0.
+                __m128i clock = _mm_and_si128(_mm_srli_epi32(stepped, PHASEACC_BITS), noise_lanes);
+                __m128i out_bit = _mm_sub_epi32(zero, _mm_and_si128(noise_state, clock));
+                __m128i shift = _mm_sub_epi32(zero, clock);
+
+                // SSE2 has no per-lane shift, so pick the shifted register
+                // where the clock ticked.
+                noise_state = _mm_or_si128(_mm_and_si128(shift, _mm_srli_epi32(noise_state, 1)),
+                                           _mm_andnot_si128(shift, noise_state));
+                noise_state = _mm_xor_si128(noise_state, _mm_and_si128(out_bit, noise_taps));
+                scaled = _mm_or_si128(_mm_andnot_si128(noise_lanes, scaled),
+                                      _mm_and_si128(noise_lanes, _mm_and_si128(noise_state, noise_mask)));
+            }
+            _mm_storeu_si128((__m128i *)position, scaled);
+
+            fetch_sample_pairs(lanes, group, 4, position, pairs);
+            weights = _mm_or_si128(_mm_sub_epi32(full_weight, distance), _mm_slli_epi32(distance, 16));
+            output = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)pairs), weights);
+            output = _mm_add_epi32(output, _mm_and_si128(_mm_srai_epi32(output, 31), phase_mask));
+            output = _mm_srai_epi32(output, PHASEACC_BITS);
+
+            level = _mm_add_epi32(level, step);
+            envelope = _mm_srai_epi32(level, ENVELOPE_BITS - ENVELOPE_GAIN_BITS);
+            if (scale)
+                envelope = _mm_srai_epi32(mullo_epi32_sse2(envelope, gain), ENVELOPE_GAIN_BITS);
+            output = mullo_epi32_sse2(output, envelope);
+            output = _mm_srai_epi32(output, VOICE_SHIFT);
+            output = _mm_add_epi32(output, _mm_shuffle_epi32(output, _MM_SHUFFLE(1, 0, 3, 2)));
+            output = _mm_add_epi32(output, _mm_shuffle_epi32(output, _MM_SHUFFLE(2, 3, 0, 1)));
+            mix[frame] += _mm_cvtsi128_si32(output);
+
+            // Count down the lanes whose phase has an end, and hand any that
+            // finish to the scalar envelope code.
+            counting = _mm_andnot_si128(_mm_cmpeq_epi32(remaining, zero), one);
+            remaining = _mm_sub_epi32(remaining, counting);
+            ended = _mm_and_si128(_mm_cmpeq_epi32(remaining, zero), _mm_cmpeq_epi32(counting, one));
+            if (_mm_movemask_ps(_mm_castsi128_ps(ended))) {
+                STORE_LANES(phase_accumulator, phase);
+                STORE_LANES(envelope_level, level);
+                STORE_LANES(envelope_remaining, remaining);
+                finish_phases(engine, group, _mm_movemask_ps(_mm_castsi128_ps(ended)));
+                level = LOAD_LANES(envelope_level);
+                step = LOAD_LANES(envelope_step);
+                remaining = LOAD_LANES(envelope_remaining);
+            }
+        }
+
+        STORE_LANES(phase_accumulator, phase);
+        STORE_LANES(envelope_level, level);
+        STORE_LANES(envelope_remaining, remaining);
+        STORE_LANES(noise_state, noise_state);
+#undef LOAD_LANES
+#undef STORE_LANES
+    }
+}
+#define mix_voices_simd mix_voices_sse2
+
+#elif defined(DESKTOP) && !defined(NO_SIMD) && defined(__AVX2__)
+// The same as the SSE2 mixer, eight voices at a time.
+static void mix_voices_avx2(struct ltc_sound_engine *engine, int32_t *mix, size_t frames)
+{
+    struct ltc_voice_lanes *lanes = &engine->lanes;
+    const __m256i phase_mask = _mm256_set1_epi32(PHASEACC_MAX - 1);
+    const __m256i full_weight = _mm256_set1_epi32(PHASEACC_MAX);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t frame;
+    int group;
+
+    for (group = 0; group < engine->voice_count; group += 8) {
+        __m256i phase, increment, length, distance_mask, level, step, remaining, gain;
+        __m256i noise_state, noise_taps, noise_lanes, noise_mask;
+        int scale, noise;
+
+        if (!((engine->active_voices >> group) & 0xff))
+            continue;
+
+#define LOAD_LANES(field) _mm256_loadu_si256((const __m256i *)&lanes->field[group])
+#define STORE_LANES(field, v) _mm256_storeu_si256((__m256i *)&lanes->field[group], v)
+        phase = LOAD_LANES(phase_accumulator);
+        increment = LOAD_LANES(phase_increment);
+        length = LOAD_LANES(length);
+        distance_mask = LOAD_LANES(distance_mask);
+        level = LOAD_LANES(envelope_level);
+        step = LOAD_LANES(envelope_step);
+        remaining = LOAD_LANES(envelope_remaining);
+        gain = LOAD_LANES(gain);
+        scale = _mm256_movemask_epi8(_mm256_cmpeq_epi32(gain, _mm256_set1_epi32(GAIN_ONE))) != -1;
+        noise_state = LOAD_LANES(noise_state);
+        noise_taps = LOAD_LANES(noise_taps);
+        noise_lanes = _mm256_cmpeq_epi32(noise_taps, zero);
+        noise = _mm256_movemask_epi8(noise_lanes) != -1;
+        noise_lanes = _mm256_andnot_si256(noise_lanes, _mm256_set1_epi32(-1));
+        noise_mask = _mm256_sub_epi32(length, one);
+
+        for (frame = 0; frame < frames; frame++) {
+            uint32_t position[8], pairs[8];
+            __m256i stepped, scaled, distance, weights, output, envelope, counting, ended;
+            __m128i half;
+
+            stepped = _mm256_add_epi32(phase, increment);
+            phase = _mm256_and_si256(stepped, phase_mask);
+            scaled = _mm256_mullo_epi32(phase, length);
+            distance = _mm256_and_si256(scaled, distance_mask);
+            scaled = _mm256_srli_epi32(scaled, PHASEACC_BITS);
+            if (noise) {
+                // AVX2 can shift each lane by its own count, so the clock
+                // is the shift.
+                __m256i clock = _mm256_and_si256(_mm256_srli_epi32(stepped, PHASEACC_BITS), noise_lanes);
+                __m256i out_bit = _mm256_sub_epi32(zero, _mm256_and_si256(noise_state, clock));
+
+                noise_state = _mm256_xor_si256(_mm256_srlv_epi32(noise_state, clock),
+                                               _mm256_and_si256(out_bit, noise_taps));
+                scaled = _mm256_blendv_epi8(scaled, _mm256_and_si256(noise_state, noise_mask), noise_lanes);
+            }
+            _mm256_storeu_si256((__m256i *)position, scaled);
+
+            fetch_sample_pairs(lanes, group, 8, position, pairs);
+            weights = _mm256_or_si256(_mm256_sub_epi32(full_weight, distance), _mm256_slli_epi32(distance, 16));
+            output = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)pairs), weights);
+            output = _mm256_add_epi32(output, _mm256_and_si256(_mm256_srai_epi32(output, 31), phase_mask));
+            output = _mm256_srai_epi32(output, PHASEACC_BITS);
+
+            level = _mm256_add_epi32(level, step);
+            envelope = _mm256_srai_epi32(level, ENVELOPE_BITS - ENVELOPE_GAIN_BITS);
+            if (scale)
+                envelope = _mm256_srai_epi32(_mm256_mullo_epi32(envelope, gain), ENVELOPE_GAIN_BITS);
+            output = _mm256_mullo_epi32(output, envelope);
+            output = _mm256_srai_epi32(output, VOICE_SHIFT);
+            half = _mm_add_epi32(_mm256_castsi256_si128(output), _mm256_extracti128_si256(output, 1));
+            half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+            half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+            mix[frame] += _mm_cvtsi128_si32(half);
+
+            counting = _mm256_andnot_si256(_mm256_cmpeq_epi32(remaining, zero), one);
+            remaining = _mm256_sub_epi32(remaining, counting);
+            ended = _mm256_and_si256(_mm256_cmpeq_epi32(remaining, zero), _mm256_cmpeq_epi32(counting, one));
+            if (_mm256_movemask_ps(_mm256_castsi256_ps(ended))) {
+                STORE_LANES(phase_accumulator, phase);
+                STORE_LANES(envelope_level, level);
+                STORE_LANES(envelope_remaining, remaining);
+                finish_phases(engine, group, _mm256_movemask_ps(_mm256_castsi256_ps(ended)));
+                level = LOAD_LANES(envelope_level);
+                step = LOAD_LANES(envelope_step);
+                remaining = LOAD_LANES(envelope_remaining);
+            }
+        }
+
+        STORE_LANES(phase_accumulator, phase);
+        STORE_LANES(envelope_level, level);
+        STORE_LANES(envelope_remaining, remaining);
+        STORE_LANES(noise_state, noise_state);
+#undef LOAD_LANES
+#undef STORE_LANES
+    }
+}
+#define mix_voices_simd mix_voices_avx2
+
+#else
+#define mix_voices mix_voices_scalar
+#endif
+
+// Band-limited voices only go through get_sample(), so any run that
+// includes one is mixed by the scalar mixer.
+#ifdef mix_voices_simd
+static inline void mix_voices(struct ltc_sound_engine *engine, int32_t *mix, size_t frames)
+{
+    if (engine->active_voices & engine->polyblep_voices)
+        mix_voices_scalar(engine, mix, frames);
+    else
+        mix_voices_simd(engine, mix, frames);
+}
+#endif
+
+// Render `frames` mixed samples into `out`.  The sequencer only runs on
+// samples where some channel has something to do; the stretches between
+// are skipped over and mixed in one go, up to MIX_RUN samples at a time.
+// This is the only place that steps the engine, so callers may ask for a
+// single sample (the PWM handoff) or a whole block (offline rendering) and
+// get identical output either way.
+void render_block(struct ltc_sound_engine *engine, int16_t *out, size_t frames)
+{
+    int32_t mix[MIX_RUN];
+    size_t frame = 0;
+
+    while (frame < frames) {
+        uint32_t run = 0, limit = MIX_RUN, idle;
+#ifdef CYCLE_STATS
+        uint32_t start = cycle_now(), bus_start;
+
+        memset(&engine->cycles.context, 0, sizeof(engine->cycles.context));
+#endif
+
+        if (limit > frames - frame)
+            limit = frames - frame;
+
+#if SFX_CHANNELS
+        // Stop short of the next sound effect, so it starts on its sample.
+        idle = sfx_poll(engine);
+        if (limit > idle)
+            limit = idle;
+#endif
+
+        // Likewise for songs starting and gains moving.
+        idle = players_update(engine);
+        if (limit > idle)
+            limit = idle;
+
+        if (!sequencer_idle(engine)) {
+            play_routine_step(engine);
+#if SONG_STREAMING
+            song_prefetch(engine);
+#endif
+            run = 1;
+        }
+
+        idle = sequencer_idle(engine);
+        if (idle > limit - run)
+            idle = limit - run;
+        sequencer_skip(engine, idle);
+        run += idle;
+
+        memset(mix, 0, run * sizeof(*mix));
+        mix_voices(engine, mix, run);
+
+#ifdef CYCLE_STATS
+        bus_start = cycle_now();
+#endif
+        bus_mix(engine, mix, out + frame, run);
+#ifdef CYCLE_STATS
+        cycle_stats_add(&engine->cycles.bus, cycles_since(bus_start), run, &engine->cycles.context);
+        cycle_stats_add(&engine->cycles.sample, cycles_since(start), run, &engine->cycles.context);
+#endif
+        frame += run;
+        index_store(&engine->sample_count, engine->sample_count + run);
+    }
+}
+
+#ifdef CYCLE_STATS
+// Start collecting timings afresh.
+void cycle_profile_reset(struct ltc_sound_engine *engine)
+{
+    memset(&engine->cycles, 0, sizeof(engine->cycles));
+#ifdef ARDUINO_APP
+    // Let SysTick free-run over its whole range if nothing else started it.
+    if (!(SYST_CSR & 1)) {
+        SYST_RVR = 0xffffff;
+        SYST_CVR = 0;
+        SYST_CSR = (1 << 2) | (1 << 0);
+    }
+#endif
+}
+
+#ifdef DESKTOP
+static void cycle_stats_print(FILE *out, const char *name, const struct cycle_stats *stats)
+{
+    int bucket;
+
+    if (!stats->count)
+        return;
+    fprintf(out, "%s: %u calls, min %u, avg %.1f, max %u (ops %u, last op 0x%04x, "
+            "envelope changes %u, phase %u)\n",
+            name, stats->count, stats->min, (double)stats->total / stats->count,
+            stats->max, stats->worst.ops, stats->worst.op,
+            stats->worst.transitions, stats->worst.phase);
+    for (bucket = 0; bucket < CYCLE_BUCKETS; bucket++)
+        if (stats->histogram[bucket])
+            fprintf(out, "  %5u%s %u\n", (unsigned)bucket << CYCLE_BUCKET_SHIFT,
+                    (bucket == CYCLE_BUCKETS - 1) ? "+" : " ", stats->histogram[bucket]);
+}
+
+void cycle_profile_print(FILE *out, const struct ltc_sound_engine *engine)
+{
+    cycle_stats_print(out, "sample", &engine->cycles.sample);
+    cycle_stats_print(out, "get_sample", &engine->cycles.voice);
+    cycle_stats_print(out, "bus", &engine->cycles.bus);
+    cycle_stats_print(out, "dither", &engine->cycles.dither);
+    // Single samples are dwarfed by the cost of timing them, and by
+    // interrupts, so the budget is held against the average.
+    if (engine->cycles.bus.count && engine->cycles.dither.count) {
+        double average = (double)engine->cycles.bus.total / engine->cycles.bus.count +
+                         (double)engine->cycles.dither.total / engine->cycles.dither.count;
+
+        fprintf(out, "bus budget: %u cycles per sample, average %.1f, %s\n", BUS_CYCLE_BUDGET,
+                average, (average <= BUS_CYCLE_BUDGET) ? "kept" : "exceeded");
+    }
+}
+#endif /* DESKTOP */
+#endif /* CYCLE_STATS */
+
+#ifndef DESKTOP
+// Producer side, called from loop().  Once enough of the FIFO has drained,
+// fill the free slots and publish them all at once.  The bus puts out
+// 16-bit samples and the ring holds 8-bit PWM values, so each run goes
+// through a buffer on the stack and is brought down to 8 bits straight
+// into the ring.  The buffer is one mix run long, which is all
+// render_block() mixes at a time anyway.
+static void sample_fifo_refill(struct ltc_sound_engine *engine)
+{
+    struct sample_fifo *fifo = &engine->fifo;
+    int16_t block[MIX_RUN];
+    uint16_t head = fifo->head;
+    uint16_t space = SAMPLE_FIFO_DEPTH - (uint16_t)(head - index_load(&fifo->tail));
+
+    if (space < SAMPLE_FIFO_BURST)
+        return;
+
+    while (space) {
+        uint16_t offset = head & (SAMPLE_FIFO_DEPTH - 1);
+        uint16_t count = SAMPLE_FIFO_DEPTH - offset;
+
+        // Render up to the end of the ring, then wrap around.
+        if (count > space)
+            count = space;
+        if (count > MIX_RUN)
+            count = MIX_RUN;
+
+        render_block(engine, block, count);
+        bus_to_pwm(engine, block, &fifo->samples[offset], count);
+
+        head += count;
+        space -= count;
+    }
+
+    compiler_barrier();
+    index_store(&fifo->head, head);
+}
+#endif /* !DESKTOP */
+
+#ifdef ARDUINO_APP
+
+#include "Arduino.h"
+#include "ChibiOS.h"
+#include "kl02.h"
+#include "memio.h"
+
+static int pwm0_stable_timer(void)
+{
+    static int loops = 0;
+
+    loops++;
+    if (loops > PWM_DELAY_LOOPS)
+    {
+        uint8_t scaled_sample = sample_fifo_pop(&engine.fifo);
+        writel(scaled_sample, TPM0_C1V);
+        writel(scaled_sample, TPM0_C0V);
+
+        loops = 0;
+    }
+
+    static int other_loops;
+    if (other_loops++ > 12) {
+        engine.tick_counter = engine.tick_counter + 1;
+        other_loops = 0;
+    }
+
+    /* Reset the timer IRQ, to allow us to fire again next time */
+    writel(TPM0_STATUS_CH1F | TPM0_STATUS_CH0F | TPM0_STATUS_TOF, TPM0_STATUS);
+
+    return 0;
+}
+
+static void prepare_pwm()
+{
+    // Write dummy values out, to configure PWM mux
+    pinMode(0, OUTPUT);
+    analogWrite(0, 63);
+    pinMode(1, OUTPUT);
+    analogWrite(1, 63);
+
+    // Disable TPM0, allowing us to configure it
+    writel(0, TPM0_SC);
+
+    // Also disable both channels, which are running from the
+    // calls to analogWrite() above
+    writel(0, TPM0_C0SC);
+    writel(0, TPM0_C1SC);
+
+    // Configure the TPM to use the MCGFLLCLK (~32 MHz?)
+    writel(readl(SIM_SOPT2) | (1 << 24), SIM_SOPT2);
+
+    // We've picked pin 0, which is on TPM0_CH1
+    writel(255, TPM0_MOD);
+    writel(0, TPM0_CNT);
+
+    writel(TPM0_C0SC_MSB | TPM0_C0SC_ELSB, TPM0_C0SC);
+    writel(TPM0_C1SC_MSB | TPM0_C1SC_ELSA, TPM0_C1SC);
+
+    writel(100, TPM0_C1V);
+    writel(100, TPM0_C0V);
+    writel(TPM0_CONF_TRGSEL(8), TPM0_CONF);
+    writel(TPM0_SC_TOF | TPM0_SC_TOIE | TPM0_SC_CMOD(1) | TPM0_SC_PS(0), TPM0_SC); // Enable TPM0
+
+    /* Enable the IRQ in the system-wide interrupt table */
+    attachFastInterrupt(PWM0_IRQ, pwm0_stable_timer);
+}
+#endif
+
+void setup(void)
+{
+    engine_init(&engine, MAX_VOICES, VOICE_STEAL_RELEASED_FIRST);
+    if (setSong(&engine, &sample_song))
+        panic(engine.song_error.message);
+#ifdef CYCLE_STATS
+    cycle_profile_reset(&engine);
+#endif
+#ifdef ARDUINO_APP
+    // Start with a full FIFO so the first interrupts have something to play.
+    sample_fifo_refill(&engine);
+    prepare_pwm();
+    enableInterrupt(PWM0_IRQ);
+    pinMode(2, OUTPUT);
+    pinMode(3, OUTPUT);
+    pinMode(4, OUTPUT);
+    pinMode(5, OUTPUT);
+#endif
+}
+
+// Number of samples rendered per loop() call on the desktop.
+#define RENDER_BLOCK_SIZE 1024
+
+void loop(void)
+{
+#ifdef DESKTOP
+    static int16_t block[RENDER_BLOCK_SIZE];
+    static uint8_t pwm_block[RENDER_BLOCK_SIZE];
+
+    render_block(&engine, block, RENDER_BLOCK_SIZE);
+    bus_to_pwm(&engine, block, pwm_block, RENDER_BLOCK_SIZE);
+    fwrite(pwm_block, 1, RENDER_BLOCK_SIZE, stdout);
+    fflush(stdout);
+    engine.tick_counter = engine.tick_counter + RENDER_BLOCK_SIZE;
+#else /* !DESKTOP */
+    // Top up the FIFO if the interrupt has drained enough of it.
+    sample_fifo_refill(&engine);
+#endif /* DESKTOP */
+}
+
+#ifdef DESKTOP
+enum render_format {
+    FORMAT_U8,      // Raw unsigned 8-bit, exactly what the PWM would play
+    FORMAT_WAV16,   // Signed 16-bit mono WAV
+};
+
+// Samples rendered per write when rendering to a file.
+#define OFFLINE_BLOCK_SIZE 65536
+
+// "Until the end" gives up after this long, since most songs loop forever.
+#define OFFLINE_MAX_SECONDS 600
+
+struct render_options {
+    const char *path;       // NULL renders without writing anything
+    enum render_format format;
+    uint32_t frames;        // At the engine's rate; 0 renders until song_finished()
+    uint32_t engine_rate;
+    uint32_t rate;          // Output rate, resampled up from the engine's
+    uint8_t voices;
+    const struct ltc_song *song;
+
+    // If not negative, the slot whose instrument replaces every one the
+    // song picks
+    int instrument;
+
+    // If set, an instrument container to register in the first slot after
+    // the built-in ones
+    const void *instrument_container;
+    uint32_t instrument_size;
+
+    // If nonzero, trigger blip_sfx every this many samples
+    uint32_t sfx_period;
+
+    // If nonzero, crossfade to the song from the top on this sample
+    uint32_t crossfade_at;
+
+    // If not negative, turn the song down to this percent under effects
+    int duck;
+
+    // The mix bus's master gain in percent, and whether to turn off its
+    // dither and soft clipping
+    uint8_t volume;
+    uint8_t plain_bus;
+};
+
+// Highest output rate, which keeps a play period's worth of output to at
+// least one engine sample.
+#define RESAMPLE_MAX_RATE 192000
+
+// How long the -c crossfade takes, in samples.
+#define CROSSFADE_LENGTH(engine) (2 * (engine)->sample_rate)
+
+// How quickly -d ducks under effects and comes back up, in samples.
+#define DUCK_ATTACK(engine) MS_TO_SAMPLES(engine, 20)
+#define DUCK_RELEASE(engine) MS_TO_SAMPLES(engine, 250)
+
+struct render_result {
+    uint32_t frames;        // At the output rate
+    uint32_t hash;          // FNV-1a of the rendered bytes
+    double seconds;
+    double cpu_seconds;     // time this thread spent rendering
+    int status;
+};
+
+// Everything one render needs, so several can run at once.
+struct render_scratch {
+    struct ltc_sound_engine engine;
+    struct ltc_resampler resampler;
+    int16_t block[OFFLINE_BLOCK_SIZE];
+    int16_t resampled[OFFLINE_BLOCK_SIZE];
+    uint8_t bytes[OFFLINE_BLOCK_SIZE * 2];
+};
+
+static double now_seconds(void)
+{
+#ifdef _WIN32
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+static double thread_seconds(void)
+{
+#ifdef _WIN32
+    return now_seconds();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+// A WAV going down a pipe can't have its sizes patched at the end, so it
+// says 0xffffffff instead, which most readers take to mean "until EOF".
+#define WAV_UNKNOWN_LENGTH 0xffffffffu
+
+static void make_wav_header(uint8_t *header, uint32_t rate, uint32_t frames)
+{
+    uint32_t data_bytes = (frames == WAV_UNKNOWN_LENGTH) ? WAV_UNKNOWN_LENGTH : frames * 2;
+
+    memcpy(header, "RIFF", 4);
+    put_le32(header + 4, (frames == WAV_UNKNOWN_LENGTH) ? WAV_UNKNOWN_LENGTH : 36 + data_bytes);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_le32(header + 16, 16);          // fmt chunk size
+    put_le16(header + 20, 1);           // PCM
+    put_le16(header + 22, 1);           // mono
+    put_le32(header + 24, rate);
+    put_le32(header + 28, rate * 2);    // bytes per second
+    put_le16(header + 32, 2);           // bytes per frame
+    put_le16(header + 34, 16);          // bits per sample
+    memcpy(header + 36, "data", 4);
+    put_le32(header + 40, data_bytes);
+}
+
+#if SFX_CHANNELS
+// A rising arpeggio, for trying out trigger_sfx().
+static const uint16_t blip_sfx_pattern[] = {
+    NE(SET_INSTRUMENT, 1),
+    NAT(5),
+    NE(SET_ATTACK_LEVEL, 60),
+    NDT(30),
+    NE(SET_DECAY_LEVEL, 40),
+    NE(SET_SUSTAIN_LEVEL, 30),
+    NRT(40),
+    NE(SET_MIDDLE_C, 71-12),
+    NN(12, N_16, 0),
+    NN(19, N_16, 0),
+    NN(24, N_8, 0),
+    NE(CHANNEL_END, 0),
+};
+
+static const uint16_t *blip_sfx_patterns[] = {
+    blip_sfx_pattern,
+};
+
+static const struct ltc_song blip_sfx = {
+    .patterns = blip_sfx_patterns,
+    .pattern_count = 1,
+    .channel_count = 1,
+};
+
+static void sfx_stats_print(FILE *out, const struct ltc_sound_engine *engine)
+{
+    const struct ltc_sfx_stats *stats = &engine->sfx_stats;
+
+    fprintf(out, "sfx: %u started, %u late, %u refused, %u dropped",
+            stats->started, stats->late, stats->refused, engine->sfx_queue.dropped);
+    if (stats->started)
+        fprintf(out, ", latency min %u avg %.1f max %u samples (max %.2f ms)",
+                stats->latency_min, (double)stats->latency_total / stats->started,
+                stats->latency_max, stats->latency_max * 1000.0 / engine->sample_rate);
+    fprintf(out, "\n");
+}
+#endif
+
+// Set up `engine` to play opts->song as `opts` says, and `resampler` to
+// take its output up to opts->rate.  Returns 0, or 1 if the song is
+// refused.
+static int render_setup(struct ltc_sound_engine *engine, struct ltc_resampler *resampler,
+                        const struct render_options *opts)
+{
+    if (resampler_init(resampler, opts->engine_rate, opts->rate)) {
+        fprintf(stderr, "can't resample from %u Hz down to %u Hz\n", opts->engine_rate, opts->rate);
+        return 1;
+    }
+    engine_init(engine, opts->voices, VOICE_STEAL_RELEASED_FIRST);
+    engine_set_sample_rate(engine, opts->engine_rate);
+    if (opts->instrument_container &&
+        engine_load_instrument(engine, ARRAY_SIZE(instruments), opts->instrument_container,
+                               opts->instrument_size)) {
+        fprintf(stderr, "bad instrument: %s\n", engine->instrument_error);
+        return 1;
+    }
+    if (opts->instrument >= 0)
+        engine->instrument_override = &engine->instruments[opts->instrument];
+    engine_set_volume(engine, opts->volume);
+    engine->dither = engine->dither && !opts->plain_bus;
+    engine->soft_clip = engine->soft_clip && !opts->plain_bus;
+    if (setSong(engine, opts->song)) {
+        fprintf(stderr, "bad song: pattern %u, op %u: %s\n", engine->song_error.pattern,
+                engine->song_error.offset, engine->song_error.message);
+        return 1;
+    }
+    if (opts->crossfade_at)
+        crossfade_to(engine, opts->song, opts->crossfade_at, CROSSFADE_LENGTH(engine));
+    if (opts->duck >= 0)
+        engine_set_ducking(engine, opts->duck, DUCK_ATTACK(engine), DUCK_RELEASE(engine));
+    return 0;
+}
+
+// Render a song as fast as the CPU allows, on its own engine.  Samples are
+// converted a block at a time and written with one fwrite() per block.
+static int render_song(const struct render_options *opts,
+                       struct render_scratch *scratch,
+                       struct render_result *result)
+{
+    struct ltc_sound_engine *engine = &scratch->engine;
+    uint8_t header[44];
+    uint32_t limit = opts->frames ? opts->frames : opts->engine_rate * OFFLINE_MAX_SECONDS;
+    uint32_t rendered = 0;
+    uint32_t hash = 2166136261u;
+    double start = now_seconds();
+    double cpu_start = thread_seconds();
+    FILE *output = 0;
+    long header_at = -1;
+#if SFX_CHANNELS
+    uint32_t next_sfx = opts->sfx_period;
+#endif
+
+    memset(result, 0, sizeof(*result));
+
+    if (render_setup(engine, &scratch->resampler, opts)) {
+        result->status = 1;
+        return 1;
+    }
+
+    if (opts->path && !strcmp(opts->path, "-"))
+        output = stdout;
+    else if (opts->path)
+        output = fopen(opts->path, "wb");
+    if (opts->path && !output) {
+        perror(opts->path);
+        result->status = 1;
+        return 1;
+    }
+
+    // The size fields are patched once the length is known, if the output
+    // can seek.  Standard output may be a file or a pipe.
+    if (output && (opts->format == FORMAT_WAV16)) {
+        header_at = ftell(output);
+        make_wav_header(header, opts->rate, (header_at < 0) ? WAV_UNKNOWN_LENGTH : 0);
+        fwrite(header, 1, sizeof(header), output);
+    }
+
+    while (rendered < limit) {
+        uint32_t count = limit - rendered;
+        uint32_t i, size, frames;
+        const int16_t *block = scratch->block;
+
+        if (!opts->frames && song_finished(engine))
+            break;
+        if (count > OFFLINE_BLOCK_SIZE / scratch->resampler.ratio)
+            count = OFFLINE_BLOCK_SIZE / scratch->resampler.ratio;
+
+#if SFX_CHANNELS
+        // Queue the effects due in this block, a block at a time so the
+        // queue never fills up.
+        if (opts->sfx_period) {
+            if (count > opts->sfx_period)
+                count = opts->sfx_period;
+            while ((next_sfx < rendered + count) &&
+                   !trigger_sfx_at(engine, &blip_sfx, 0, next_sfx))
+                next_sfx += opts->sfx_period;
+        }
+#endif
+
+        render_block(engine, scratch->block, count);
+        frames = count;
+        if (scratch->resampler.step) {
+            frames = resample_block(&scratch->resampler, scratch->block, count, scratch->resampled);
+            block = scratch->resampled;
+        }
+
+        // WAVs get the mix bus's full 16 bits.
+        if (opts->format == FORMAT_WAV16) {
+            for (i = 0; i < frames; i++)
+                put_le16(scratch->bytes + i * 2, block[i]);
+            size = frames * 2;
+        }
+        else {
+            bus_to_pwm(engine, block, scratch->bytes, frames);
+            size = frames;
+        }
+
+        for (i = 0; i < size; i++)
+            hash = (hash ^ scratch->bytes[i]) * 16777619u;
+        if (output)
+            fwrite(scratch->bytes, 1, size, output);
+        rendered += count;
+        result->frames += frames;
+    }
+
+    result->hash = hash;
+    result->seconds = now_seconds() - start;
+    result->cpu_seconds = thread_seconds() - cpu_start;
+
+    if (!output)
+        return 0;
+
+    if ((opts->format == FORMAT_WAV16) && (header_at >= 0)) {
+        make_wav_header(header, opts->rate, result->frames);
+        if (fseek(output, header_at, SEEK_SET) || (fwrite(header, 1, sizeof(header), output) != sizeof(header)))
+            result->status = 1;
+    }
+
+    if (ferror(output) || ((output != stdout) && fclose(output)))
+        result->status = 1;
+    if (result->status)
+        perror(opts->path);
+    return result->status;
+}
+
+// A song container on disk.  It's either streamed through stdio, the way
+// the badge would play it from SPI flash, or loaded whole and played in
+// place with song_load().
+struct song_file {
+    struct ltc_song song;
+    FILE *file;
+    uint8_t *data;          // Whole container, if it's loaded
+    size_t size;            // In bytes
+    int mapped;             // If `data` came from mmap() rather than malloc()
+#if SONG_STREAMING
+    struct ltc_song_source source;
+    uint32_t addresses[256];
+    uint8_t instruments[256];
+#endif
+};
+
+static void song_file_close(struct song_file *song_file)
+{
+#ifndef _WIN32
+    if (song_file->mapped)
+        munmap(song_file->data, song_file->size);
+    else
+#endif
+    free(song_file->data);
+    if (song_file->file)
+        fclose(song_file->file);
+    memset(song_file, 0, sizeof(*song_file));
+}
+
+#if SONG_STREAMING
+static void get_words(uint16_t *words, const uint8_t *bytes, uint32_t count)
+{
+    uint32_t i;
+
+    for (i = 0; i < count; i++)
+        words[i] = get_le16(bytes + i * 2);
+}
+
+static uint32_t song_file_read(void *context, uint32_t address, uint16_t *words, uint32_t count)
+{
+    struct song_file *song_file = (struct song_file *)context;
+    uint8_t bytes[2 * SONG_CACHE_WORDS];
+    uint32_t total = 0;
+
+    if (fseek(song_file->file, (long)address * 2, SEEK_SET))
+        return 0;
+    while (total < count) {
+        uint32_t chunk = count - total;
+        size_t got;
+
+        if (chunk > SONG_CACHE_WORDS)
+            chunk = SONG_CACHE_WORDS;
+        got = fread(bytes, 2, chunk, song_file->file);
+        get_words(words + total, bytes, got);
+        total += got;
+        if (got < chunk)
+            break;
+    }
+    return total;
+}
+
+// Read the tables from the file and check the rest against the checksum,
+// leaving the patterns to be read as they're played.
+static int song_file_stream(struct song_file *song_file, struct ltc_song_error *error)
+{
+    struct ltc_song *song = &song_file->song;
+    struct ltc_song_layout layout;
+    uint8_t bytes[4 * 256];
+    uint32_t hash = 2166136261u, offset, end;
+    size_t got;
+    int i;
+
+    got = fread(bytes, 1, SONG_HEADER_BYTES, song_file->file);
+    if (song_container_header(song, &layout, bytes, got < SONG_HEADER_BYTES ? got : song_file->size, error))
+        return -1;
+
+    end = song->word_count * 2;
+    for (offset = layout.addresses; offset < end; offset += got) {
+        got = end - offset;
+        if (got > sizeof(bytes))
+            got = sizeof(bytes);
+        if (fseek(song_file->file, offset, SEEK_SET) || (fread(bytes, 1, got, song_file->file) != got))
+            return song_error(error, "song container is truncated", 0, 0);
+        hash = song_checksum(hash, bytes, got);
+    }
+    if (hash != layout.checksum)
+        return song_error(error, "song container checksum doesn't match", 0, 0);
+
+    if (fseek(song_file->file, layout.addresses, SEEK_SET) ||
+        (fread(bytes, 4, song->pattern_count, song_file->file) != song->pattern_count))
+        return song_error(error, "song container is truncated", 0, 0);
+    for (i = 0; i < song->pattern_count; i++)
+        song_file->addresses[i] = get_le32(bytes + i * 4);
+    if (fread(song_file->instruments, 1, song->instrument_count, song_file->file) != song->instrument_count)
+        return song_error(error, "song container is truncated", 0, 0);
+
+    song->pattern_addresses = song_file->addresses;
+    if (song->instrument_count)
+        song->instruments = song_file->instruments;
+    song->source = &song_file->source;
+    song_file->source.read = song_file_read;
+    song_file->source.context = song_file;
+    return 0;
+}
+#endif /* SONG_STREAMING */
+
+// Bring the whole container into memory and play it from there: mapped
+// where there's mmap(), read in otherwise.
+static int song_file_load(struct song_file *song_file, struct ltc_song_error *error)
+{
+#ifndef _WIN32
+    void *mapped = mmap(0, song_file->size, PROT_READ, MAP_PRIVATE, fileno(song_file->file), 0);
+
+    if (mapped != MAP_FAILED) {
+        song_file->data = (uint8_t *)mapped;
+        song_file->mapped = 1;
+    }
+#endif
+    if (!song_file->data) {
+        song_file->data = (uint8_t *)malloc(song_file->size ? song_file->size : 1);
+        if (!song_file->data || (fread(song_file->data, 1, song_file->size, song_file->file) != song_file->size))
+            return song_error(error, "couldn't read song container", 0, 0);
+    }
+    return song_load(&song_file->song, song_file->data, song_file->size, error);
+}
+
+// Open a song container for playing.  If `load` is set, or streaming isn't
+// built in, it's played from memory; otherwise it's streamed from the file.
+static int song_file_open(struct song_file *song_file, const char *path, int load)
+{
+    struct ltc_song_error error;
+    long size;
+    int status;
+
+    memset(song_file, 0, sizeof(*song_file));
+    song_file->file = fopen(path, "rb");
+    if (!song_file->file || fseek(song_file->file, 0, SEEK_END) || ((size = ftell(song_file->file)) < 0)) {
+        perror(path);
+        song_file_close(song_file);
+        return -1;
+    }
+    song_file->size = size;
+    rewind(song_file->file);
+
+#if SONG_STREAMING
+    if (!load)
+        status = song_file_stream(song_file, &error);
+    else
+#else
+    (void)load;
+#endif
+    status = song_file_load(song_file, &error);
+
+    if (status) {
+        fprintf(stderr, "%s: %s\n", path, error.message);
+        song_file_close(song_file);
+    }
+    return status;
+}
+
+// How many words of `pattern` are played: up to its first jump or end.
+static uint32_t pattern_length(const uint16_t *pattern)
+{
+    uint32_t length;
+
+    for (length = 0; length < PATTERN_MAX_OPS; length++) {
+        uint16_t op = pattern[length];
+        uint8_t effect_num = (op >> 8) & 0x7f;
+
+        if (((op & 0xf000) == 0x8000) &&
+            ((effect_num == PATTERN_JUMP_ABS) || (effect_num == PATTERN_JUMP_REL) ||
+             (effect_num == CHANNEL_END)))
+            return length + 1;
+    }
+    return length;
+}
+
+// Write a song built from in-memory patterns out as a container, with its
+// instrument numbers and speed.
+static int song_file_write(const char *path, const struct ltc_song *song)
+{
+    uint32_t instruments = SONG_HEADER_BYTES + 4 * song->pattern_count;
+    uint32_t header_bytes = instruments + ((song->instrument_count + 1) & ~1);
+    uint32_t size = header_bytes, address, length;
+    uint8_t *container;
+    FILE *output;
+    int i, status = 0;
+
+    if (!song->patterns) {
+        fprintf(stderr, "%s: only songs built from patterns can be written\n", path);
+        return 1;
+    }
+    if (song->instrument_count && !song->instruments) {
+        fprintf(stderr, "%s: the song's instrument numbers are missing\n", path);
+        return 1;
+    }
+
+    for (i = 0; i < song->pattern_count; i++)
+        size += 2 * pattern_length(song->patterns[i]);
+    container = (uint8_t *)calloc(1, size);
+    if (!container) {
+        perror(path);
+        return 1;
+    }
+
+    memcpy(container, SONG_CONTAINER_MAGIC, 4);
+    put_le16(container + 4, SONG_CONTAINER_VERSION);
+    put_le16(container + 6, SONG_HEADER_BYTES);
+    container[8] = song->channel_count;
+    container[9] = song->pattern_count;
+    container[10] = song->instrument_count;
+    put_le16(container + 12, song->speed);
+    put_le32(container + 16, size / 2);
+    if (song->instrument_count)
+        memcpy(container + instruments, song->instruments, song->instrument_count);
+
+    address = header_bytes / 2;
+    for (i = 0; i < song->pattern_count; i++) {
+        uint32_t j;
+
+        put_le32(container + SONG_HEADER_BYTES + i * 4, address);
+        length = pattern_length(song->patterns[i]);
+        for (j = 0; j < length; j++)
+            put_le16(container + (address + j) * 2, song->patterns[i][j]);
+        address += length;
+    }
+    put_le32(container + 20, song_checksum(2166136261u, container + SONG_HEADER_BYTES,
+                                           size - SONG_HEADER_BYTES));
+
+    output = fopen(path, "wb");
+    if (!output || (fwrite(container, 1, size, output) != size) || fclose(output)) {
+        perror(path);
+        status = 1;
+    }
+    free(container);
+    return status;
+}
+
+// Write `instrument`'s table to `path` as an instrument container.  Its
+// band-limited levels, if any, aren't written.
+static int instrument_file_write(const char *path, const struct ltc_instrument *instrument)
+{
+    uint8_t header[INSTRUMENT_HEADER_BYTES];
+    FILE *output;
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, INSTRUMENT_CONTAINER_MAGIC, 4);
+    put_le16(header + 4, INSTRUMENT_CONTAINER_VERSION);
+    put_le16(header + 6, instrument->flags);
+    put_le16(header + 8, instrument->length);
+    put_le32(header + 12, song_checksum(2166136261u, (const uint8_t *)instrument->samples,
+                                        instrument->length));
+    put_le16(header + 16, instrument->noise_taps);
+    header[18] = instrument->noise_shift;
+
+    output = fopen(path, "wb");
+    if (!output || (fwrite(header, 1, sizeof(header), output) != sizeof(header)) ||
+        (fwrite(instrument->samples, 1, instrument->length, output) != instrument->length) ||
+        fclose(output)) {
+        perror(path);
+        return 1;
+    }
+    return 0;
+}
+
+// Read all of an instrument container into memory for -I.  Returns NULL
+// if it can't be read.
+static void *instrument_file_read(const char *path, uint32_t *size)
+{
+    FILE *input = fopen(path, "rb");
+    void *data = 0;
+    long length;
+
+    if (input && !fseek(input, 0, SEEK_END) && ((length = ftell(input)) >= 0)) {
+        rewind(input);
+        data = malloc(length ? length : 1);
+        if (data && (fread(data, 1, length, input) != (size_t)length)) {
+            free(data);
+            data = 0;
+        }
+        *size = length;
+    }
+    if (!data)
+        perror(path);
+    if (input)
+        fclose(input);
+    return data;
+}
+
+// A song for the batch renderer, named for its jobs and output files.
+struct batch_song {
+    char name[32];
+    const struct ltc_song *song;
+};
+
+// Rendered when -b isn't given any songs.
+static const struct batch_song builtin_batch_songs[] = {
+    { "sample", &sample_song },
+};
+
+// Instruments the batch renderer tries each song on.
+
+static const char *const instrument_names[] = {
+    "triangle",
+    "sawtooth",
+    "sine",
+    "square",
+    "noise",
+    "metallic",
+};
+
+struct batch_job {
+    char name[64];
+    struct render_options opts;
+    struct render_result result;
+};
+
+// Each worker owns a queue of jobs.  It takes work from the front of its
+// own queue, and once that's empty it steals from the back of the others,
+// so a worker stuck with a long job doesn't hold up the rest.
+struct batch_queue {
+#ifndef _WIN32
+    pthread_mutex_t lock;
+#endif
+    size_t *jobs;
+    size_t head;
+    size_t tail;
+};
+
+struct batch_pool {
+    struct batch_job *jobs;
+    struct batch_queue *queues;
+    int workers;
+};
+
+struct batch_worker {
+    struct batch_pool *pool;
+    int id;
+};
+
+// Take a job from the front (the owner) or back (a thief) of a queue.
+// Returns the job number, or -1 if the queue is empty.
+static long batch_take(struct batch_queue *queue, int steal)
+{
+    long job = -1;
+
+#ifndef _WIN32
+    pthread_mutex_lock(&queue->lock);
+#endif
+    if (queue->head < queue->tail)
+        job = steal ? queue->jobs[--queue->tail] : queue->jobs[queue->head++];
+#ifndef _WIN32
+    pthread_mutex_unlock(&queue->lock);
+#endif
+    return job;
+}
+
+static void *batch_worker(void *arg)
+{
+    struct batch_worker *worker = (struct batch_worker *)arg;
+    struct batch_pool *pool = worker->pool;
+    struct render_scratch *scratch = (struct render_scratch *)malloc(sizeof(*scratch));
+    long job;
+    int victim;
+
+    // Its jobs are stolen by the other workers, if there are any.  Any
+    // that aren't keep the failed status render_batch() gave them.
+    if (!scratch) {
+        fprintf(stderr, "batch worker %d: out of memory\n", worker->id);
+        return 0;
+    }
+
+    for (;;) {
+        job = batch_take(&pool->queues[worker->id], 0);
+        for (victim = 1; (job < 0) && (victim < pool->workers); victim++)
+            job = batch_take(&pool->queues[(worker->id + victim) % pool->workers], 1);
+        if (job < 0)
+            break;
+
+        render_song(&pool->jobs[job].opts, scratch, &pool->jobs[job].result);
+    }
+
+    free(scratch);
+    return 0;
+}
+
+// Render each of `songs` with its own instruments and with each instrument
+// in turn, across `workers` threads, each job on its own engine.  If `dir`
+// is set, each render is also written there.
+static int render_batch(const struct render_options *base, const struct batch_song *songs,
+                        size_t song_count, const char *dir, int workers)
+{
+    size_t job_count = song_count * (ARRAY_SIZE(instruments) + 1);
+    struct batch_job *jobs = (struct batch_job *)calloc(job_count, sizeof(*jobs));
+    struct batch_queue *queues;
+    struct batch_worker *threads;
+    struct batch_pool pool;
+    double start, busy = 0;
+    size_t song, job = 0;
+    int status = 0, ready, i;
+
+    if (workers < 1)
+        workers = 1;
+#ifdef _WIN32
+    workers = 1;
+#endif
+
+    queues = (struct batch_queue *)calloc(workers, sizeof(*queues));
+    threads = (struct batch_worker *)calloc(workers, sizeof(*threads));
+    if (!jobs || !queues || !threads) {
+        fprintf(stderr, "out of memory\n");
+        free(jobs);
+        free(queues);
+        free(threads);
+        return 1;
+    }
+
+    // A job stays failed unless a worker gets to render it.
+    for (song = 0; song < song_count; song++) {
+        for (i = -1; i < (int)ARRAY_SIZE(instruments); i++, job++) {
+            struct batch_job *j = &jobs[job];
+            j->opts = *base;
+            j->opts.song = songs[song].song;
+            j->opts.instrument = i;
+            snprintf(j->name, sizeof(j->name), "%s-%s", songs[song].name,
+                     (i < 0) ? "own" : instrument_names[i]);
+            j->opts.path = 0;
+            j->result.status = 1;
+        }
+    }
+
+    // Deal the jobs out round-robin.  Workers that run out steal from the
+    // others, so the queues even out however long each job takes.
+    ready = 1;
+    for (i = 0; i < workers; i++) {
+        queues[i].jobs = (size_t *)calloc(job_count, sizeof(size_t));
+        ready = ready && queues[i].jobs;
+#ifndef _WIN32
+        pthread_mutex_init(&queues[i].lock, 0);
+#endif
+    }
+    for (job = 0; ready && (job < job_count); job++) {
+        struct batch_queue *queue = &queues[job % workers];
+        if (dir) {
+            char *path = (char *)malloc(strlen(dir) + sizeof(jobs[job].name) + 8);
+            if (!path) {
+                ready = 0;
+                break;
+            }
+            sprintf(path, "%s/%s.%s", dir, jobs[job].name,
+                    (base->format == FORMAT_WAV16) ? "wav" : "raw");
+            jobs[job].opts.path = path;
+        }
+        queue->jobs[queue->tail++] = job;
+    }
+    if (!ready) {
+        fprintf(stderr, "out of memory\n");
+        status = 1;
+    }
+
+    pool.jobs = jobs;
+    pool.queues = queues;
+    pool.workers = workers;
+
+    start = now_seconds();
+#ifdef _WIN32
+    threads[0].pool = &pool;
+    if (ready)
+        batch_worker(&threads[0]);
+#else
+    if (ready) {
+        pthread_t *ids = (pthread_t *)calloc(workers, sizeof(pthread_t));
+        int started = 0;
+
+        // If a thread can't be started, the ones that did steal its jobs.
+        // If none could, this thread does them all.
+        for (i = 0; ids && (i < workers); i++) {
+            threads[i].pool = &pool;
+            threads[i].id = i;
+            if (pthread_create(&ids[started], 0, batch_worker, &threads[i]))
+                break;
+            started++;
+        }
+        if (started < workers)
+            fprintf(stderr, "started %d of %d threads\n", started, workers);
+        if (!started) {
+            threads[0].pool = &pool;
+            threads[0].id = 0;
+            batch_worker(&threads[0]);
+        }
+        for (i = 0; i < started; i++)
+            pthread_join(ids[i], 0);
+        free(ids);
+        workers = started ? started : 1;
+    }
+#endif
+
+    if (ready) {
+        printf("# job frames hash seconds cpu-seconds\n");
+        for (job = 0; job < job_count; job++) {
+            if (jobs[job].result.status)
+                printf("%s failed\n", jobs[job].name);
+            else
+                printf("%s %u %08x %.3f %.3f\n", jobs[job].name, jobs[job].result.frames,
+                       jobs[job].result.hash, jobs[job].result.seconds, jobs[job].result.cpu_seconds);
+            busy += jobs[job].result.cpu_seconds;
+            status |= jobs[job].result.status;
+        }
+        start = now_seconds() - start;
+        printf("# %u jobs on %d threads: %.3f s wall, %.3f s cpu, %.2fx\n",
+               (unsigned)job_count, workers, start, busy, busy / start);
+    }
+
+    for (job = 0; job < job_count; job++)
+        free((void *)jobs[job].opts.path);
+    for (i = 0; i < pool.workers; i++) {
+        free(queues[i].jobs);
+#ifndef _WIN32
+        pthread_mutex_destroy(&queues[i].lock);
+#endif
+    }
+    free(queues);
+    free(threads);
+    free(jobs);
+    return status;
+}
+
+// Batch-render the song containers at `paths`, or the built-in songs if
+// there are none.  Each container is loaded whole, so the workers can
+// share it, and its jobs are named for the file.
+static int render_batch_files(const struct render_options *base, const char *const *paths,
+                              int path_count, const char *dir, int workers)
+{
+    struct song_file *files;
+    struct batch_song *songs;
+    int i, opened = 0, status = 1;
+
+    if (!path_count)
+        return render_batch(base, builtin_batch_songs, ARRAY_SIZE(builtin_batch_songs), dir, workers);
+
+    files = (struct song_file *)calloc(path_count, sizeof(*files));
+    songs = (struct batch_song *)calloc(path_count, sizeof(*songs));
+    if (!files || !songs) {
+        fprintf(stderr, "out of memory\n");
+        free(files);
+        free(songs);
+        return 1;
+    }
+
+    for (opened = 0; opened < path_count; opened++) {
+        const char *name = strrchr(paths[opened], '/');
+        const char *dot;
+
+        if (song_file_open(&files[opened], paths[opened], 1))
+            break;
+        name = name ? name + 1 : paths[opened];
+        dot = strrchr(name, '.');
+        snprintf(songs[opened].name, sizeof(songs[opened].name), "%.*s",
+                 (dot && (dot != name)) ? (int)(dot - name) : (int)strlen(name), name);
+        songs[opened].song = &files[opened].song;
+    }
+    if (opened == path_count)
+        status = render_batch(base, songs, path_count, dir, workers);
+
+    for (i = 0; i < opened; i++)
+        song_file_close(&files[i]);
+    free(files);
+    free(songs);
+    return status;
+}
+
+#ifndef _WIN32
+// Real-time output.  A render thread fills one period at a time from the
+// engine, the way a sound card's callback would, and hands it to a sink,
+// which blocks until there's room for it.  That paces the thread at the
+// sample rate, so its timing can be watched on the desktop before it's
+// flashed.
+
+// Samples in one period at the output rate, about 8 ms at SAMPLE_RATE,
+// and how many periods the sink holds.
+#define PLAY_PERIOD 128
+#define PLAY_PERIODS 4
+
+#define NS_PER_SECOND 1000000000ull
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NS_PER_SECOND + now.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t when)
+{
+    struct timespec until;
+
+    until.tv_sec = when / NS_PER_SECOND;
+    until.tv_nsec = when % NS_PER_SECOND;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, 0))
+        ;
+}
+
+#ifdef __linux__
+// libasound, if it's installed.  It's loaded at runtime so the build
+// doesn't need its headers, and the other sinks work without it.
+struct alsa_api {
+    int (*open)(void **pcm, const char *name, int stream, int mode);
+    int (*set_params)(void *pcm, int format, int access, unsigned channels,
+                      unsigned rate, int soft_resample, unsigned latency);
+    long (*writei)(void *pcm, const void *buffer, unsigned long frames);
+    int (*recover)(void *pcm, int err, int silent);
+    int (*drain)(void *pcm);
+    int (*close)(void *pcm);
+    const char *(*strerror)(int err);
+};
+
+#define SND_PCM_STREAM_PLAYBACK 0
+#define SND_PCM_FORMAT_S16_LE 2
+#define SND_PCM_ACCESS_RW_INTERLEAVED 3
+#endif
+
+// Where the render thread's periods go.  Sinks are opened by
+// sink_open_alsa() or sink_open_paced().
+struct audio_sink {
+    const char *name;
+
+    // Play `frames` samples, blocking until there's room for them.  Returns
+    // how many times the sink ran dry and had to restart, or -1 on error.
+    int (*write)(struct audio_sink *sink, const int16_t *samples, uint32_t frames);
+    void (*close)(struct audio_sink *sink);
+
+    uint32_t rate;
+
+    // Paced sinks: samples go to `file`, if any, as raw signed 16-bit, and
+    // are taken at `rate` from when the first one arrived at `start`.
+    FILE *file;
+    uint64_t start;
+    uint64_t written;
+
+#ifdef __linux__
+    struct alsa_api alsa;
+    void *library;
+    void *pcm;
+#endif
+};
+
+// Stand in for a sound card that plays `rate` samples a second out of a
+// buffer of PLAY_PERIODS periods.
+static int paced_write(struct audio_sink *sink, const int16_t *samples, uint32_t frames)
+{
+    uint64_t now = now_ns(), played, room;
+    int xruns = 0;
+
+    if (!sink->written)
+        sink->start = now;
+
+    // If the buffer ran dry, the card starts again from what it has.
+    played = (now - sink->start) * sink->rate / NS_PER_SECOND;
+    if (played > sink->written) {
+        sink->start = now - sink->written * NS_PER_SECOND / sink->rate;
+        xruns = 1;
+    }
+
+    if (sink->written + frames > PLAY_PERIODS * PLAY_PERIOD) {
+        room = sink->start + (sink->written + frames - PLAY_PERIODS * PLAY_PERIOD) *
+                             NS_PER_SECOND / sink->rate;
+        if (room > now)
+            sleep_until_ns(room);
+    }
+
+    if (sink->file && (fwrite(samples, sizeof(*samples), frames, sink->file) != frames))
+        return -1;
+    sink->written += frames;
+    return xruns;
+}
+
+static void paced_close(struct audio_sink *sink)
+{
+    if (sink->file)
+        fclose(sink->file);
+}
+
+// Open a sink that keeps real time without a sound card, writing to `path`
+// if it's set and throwing the samples away otherwise.
+static int sink_open_paced(struct audio_sink *sink, const char *path, uint32_t rate)
+{
+    memset(sink, 0, sizeof(*sink));
+    sink->name = path ? path : "null";
+    sink->write = paced_write;
+    sink->close = paced_close;
+    sink->rate = rate;
+    if (path && !(sink->file = fopen(path, "wb"))) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+static int alsa_write(struct audio_sink *sink, const int16_t *samples, uint32_t frames)
+{
+    int xruns = 0;
+
+    while (frames) {
+        long done = sink->alsa.writei(sink->pcm, samples, frames);
+
+        if (done < 0) {
+            if (sink->alsa.recover(sink->pcm, done, 1) < 0) {
+                fprintf(stderr, "alsa: %s\n", sink->alsa.strerror(done));
+                return -1;
+            }
+            xruns++;
+            continue;
+        }
+        samples += done;
+        frames -= done;
+    }
+    return xruns;
+}
+
+static void alsa_close(struct audio_sink *sink)
+{
+    sink->alsa.drain(sink->pcm);
+    sink->alsa.close(sink->pcm);
+    dlclose(sink->library);
+}
+
+// Open ALSA's `device` for mono 16-bit output at `rate`, with room for
+// PLAY_PERIODS periods.  ALSA resamples if the card can't run at `rate`.
+static int sink_open_alsa(struct audio_sink *sink, const char *device, uint32_t rate)
+{
+    static const char *const names[] = {
+        "snd_pcm_open", "snd_pcm_set_params", "snd_pcm_writei", "snd_pcm_recover",
+        "snd_pcm_drain", "snd_pcm_close", "snd_strerror",
+    };
+    void **api = (void **)&sink->alsa;
+    int i, err;
+
+    memset(sink, 0, sizeof(*sink));
+    sink->name = device;
+    sink->write = alsa_write;
+    sink->close = alsa_close;
+    sink->rate = rate;
+
+    sink->library = dlopen("libasound.so.2", RTLD_NOW);
+    if (!sink->library) {
+        fprintf(stderr, "alsa: libasound isn't installed\n");
+        return -1;
+    }
+    for (i = 0; i < (int)ARRAY_SIZE(names); i++) {
+        api[i] = dlsym(sink->library, names[i]);
+        if (!api[i]) {
+            fprintf(stderr, "alsa: libasound has no %s\n", names[i]);
+            dlclose(sink->library);
+            return -1;
+        }
+    }
+
+    err = sink->alsa.open(&sink->pcm, device, SND_PCM_STREAM_PLAYBACK, 0);
+    if (!err)
+        err = sink->alsa.set_params(sink->pcm, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED,
+                                    1, rate, 1,
+                                    (uint64_t)PLAY_PERIODS * PLAY_PERIOD * 1000000 / rate);
+    if (err) {
+        fprintf(stderr, "alsa: %s: %s\n", device, sink->alsa.strerror(err));
+        if (sink->pcm)
+            sink->alsa.close(sink->pcm);
+        dlclose(sink->library);
+        return -1;
+    }
+    return 0;
+}
+#endif /* __linux__ */
+
+struct play_stats {
+    uint32_t periods;
+    uint32_t xruns;
+
+    // Time spent rendering each period, in nanoseconds
+    uint64_t fill_min;
+    uint64_t fill_max;
+    uint64_t fill_total;
+
+    // How far the time between one period starting and the next strayed
+    // from a period's length, in nanoseconds, once the sink was full
+    uint64_t jitter_max;
+    uint64_t jitter_total;
+    uint32_t jitter_count;
+};
+
+struct play_thread {
+    struct ltc_sound_engine *engine;
+    struct ltc_resampler resampler;
+    struct audio_sink *sink;
+    uint32_t frames;            // At the engine's rate; 0 plays until `stop` is set
+    uint32_t period;            // Engine samples rendered per period
+    volatile sig_atomic_t stop;
+    int status;
+
+    // How the thread was set up: the CPU it's pinned to, or -1, and whether
+    // it got real-time priority
+    int cpu;
+    int realtime;
+
+    struct play_stats stats;
+};
+
+// Pin the calling thread to the last CPU, where it's least likely to share
+// with interrupts, and ask for real-time priority.  Either may be refused
+// without root.
+static void play_thread_setup(struct play_thread *play)
+{
+    struct sched_param param;
+
+    play->cpu = -1;
+#ifdef __linux__
+    {
+        cpu_set_t cpus;
+        int cpu = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (!pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+            play->cpu = cpu;
+    }
+#endif
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO) / 2;
+    play->realtime = !pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+}
+
+static void *play_thread_run(void *arg)
+{
+    struct play_thread *play = (struct play_thread *)arg;
+    struct play_stats *stats = &play->stats;
+    uint64_t period = play->period * NS_PER_SECOND / play->engine->sample_rate;
+    uint64_t last = 0;
+    uint32_t done = 0;
+    int16_t block[PLAY_PERIOD], resampled[PLAY_PERIOD];
+
+    play_thread_setup(play);
+
+    while (!play->stop && (!play->frames || (done < play->frames))) {
+        uint32_t count = play->period, frames;
+        uint64_t start = now_ns(), fill;
+        int xruns;
+
+        // The sink doesn't hold the thread back until it's full.
+        if (stats->periods > PLAY_PERIODS) {
+            uint64_t jitter = (start - last > period) ? start - last - period : period - (start - last);
+
+            if (jitter > stats->jitter_max)
+                stats->jitter_max = jitter;
+            stats->jitter_total += jitter;
+            stats->jitter_count++;
+        }
+        last = start;
+
+        if (play->frames && (count > play->frames - done))
+            count = play->frames - done;
+        render_block(play->engine, block, count);
+        frames = resample_block(&play->resampler, block, count, resampled);
+
+        fill = now_ns() - start;
+        if (!stats->periods || (fill < stats->fill_min))
+            stats->fill_min = fill;
+        if (fill > stats->fill_max)
+            stats->fill_max = fill;
+        stats->fill_total += fill;
+        stats->periods++;
+
+        xruns = play->sink->write(play->sink, resampled, frames);
+        if (xruns < 0) {
+            play->status = 1;
+            break;
+        }
+        stats->xruns += xruns;
+        done += count;
+    }
+    return 0;
+}
+
+static void play_stats_print(FILE *out, const struct play_thread *play)
+{
+    const struct play_stats *stats = &play->stats;
+
+    fprintf(out, "play: %s at %u Hz, %u-sample periods (%.2f ms), ", play->sink->name,
+            play->sink->rate, play->period, play->period * 1e3 / play->engine->sample_rate);
+    if (play->resampler.step)
+        fprintf(out, "resampled from %u Hz, ", play->engine->sample_rate);
+    if (play->cpu >= 0)
+        fprintf(out, "pinned to CPU %d, ", play->cpu);
+    else
+        fprintf(out, "not pinned, ");
+    fprintf(out, "%s priority\n", play->realtime ? "real-time" : "normal");
+    if (!stats->periods)
+        return;
+    fprintf(out, "play: %u periods, %u xruns, fill min %.1f avg %.1f max %.1f us\n",
+            stats->periods, stats->xruns, stats->fill_min / 1e3,
+            stats->fill_total / 1e3 / stats->periods, stats->fill_max / 1e3);
+    if (stats->jitter_count)
+        fprintf(out, "play: jitter avg %.1f max %.1f us\n",
+                stats->jitter_total / 1e3 / stats->jitter_count, stats->jitter_max / 1e3);
+}
+
+static struct play_thread *play_signalled;
 
-        break;
-    }
+static void play_interrupt(int signal)
+{
+    (void)signal;
+    play_signalled->stop = 1;
 }
 
-typedef void (*effect_t)(struct ltc_sound_engine *engine, uint8_t channel, uint8_t arg);
+// Play opts->song in real time through `sink_name`: "alsa" or
+// "alsa:DEVICE" for a sound card, "null" to keep time and throw the
+// samples away, or a file to write them to as raw signed 16-bit.  Plays
+// for opts->frames samples, or until interrupted if that's 0.  Sound
+// effects are triggered from this thread, as a game's main loop would.
+static int play_song(const struct render_options *opts, const char *sink_name,
+                     struct ltc_sound_engine *engine)
+{
+    struct audio_sink sink;
+    struct play_thread play;
+    pthread_t thread;
+    int opened;
 
-static const effect_t effect_lut[] = {
-    0,
-    patternDelay,
-    patternJumpAbs,
-    setInstrument,
-    setAttackLevel,
-    setDecayLevel,
-    setSustainLevel,
-    setMiddleC,
-    patternJumpRel,
-    patternRepeatCount,
-};
+    memset(&play, 0, sizeof(play));
+    if (render_setup(engine, &play.resampler, opts))
+        return 1;
 
-void setSong(struct ltc_sound_engine *engine, const struct ltc_song *song) {
-    int voice_num;
-    engine->song = song;
+    if (!strcmp(sink_name, "null"))
+        opened = sink_open_paced(&sink, 0, opts->rate);
+    else if (!strcmp(sink_name, "alsa") || !strncmp(sink_name, "alsa:", 5)) {
+#ifdef __linux__
+        opened = sink_open_alsa(&sink, sink_name[4] ? sink_name + 5 : "default", opts->rate);
+#else
+        fprintf(stderr, "alsa is only on Linux\n");
+        opened = -1;
+#endif
+    }
+    else
+        opened = sink_open_paced(&sink, sink_name, opts->rate);
+    if (opened)
+        return 1;
 
-    for (voice_num = 0; voice_num < VOICE_COUNT; voice_num++) {
-        struct ltc_voice *voice = &engine->voices[voice_num];
-        voice->pattern = song->patterns[voice_num];
-        voice->pattern_num = voice_num;
-        voice->pattern_offset = 0;
-        voice->pattern_repeat_count = 0;
-        voice->note_duration = 0;
-        voice->rest_duration = 0;
-        voice->sustain_level = 100;
-        ADSR_PHASE(voice, PHASE_OFF);
-        voice->instrument = 0;
-        voice->middle_c = 40;
+    play.engine = engine;
+    play.sink = &sink;
+    play.frames = opts->frames;
+    // Few enough engine samples that they never resample to more than
+    // PLAY_PERIOD.
+    play.period = PLAY_PERIOD;
+    if (play.resampler.step)
+        play.period = (uint64_t)(PLAY_PERIOD - 1) * opts->engine_rate / opts->rate;
+    play_signalled = &play;
+    signal(SIGINT, play_interrupt);
+
+    if (pthread_create(&thread, 0, play_thread_run, &play)) {
+        fprintf(stderr, "can't start the render thread\n");
+        sink.close(&sink);
+        return 1;
     }
-}
 
-#define ATTACK_PHASE 1
-#define DECAY_PHASE 2
-#define SUSTAIN_PHASE 3
-#define RELEASE_PHASE 4
-#ifdef DEBUG
-#define DEBUG_PHASE(x) do { \
-writel((1 << 12), (x == ATTACK_PHASE) ? FGPIOA_PSOR : FGPIOA_PCOR); \
-writel((1 << 13), (x == DECAY_PHASE) ? FGPIOB_PSOR : FGPIOB_PCOR); \
-writel((1 << 0), (x == SUSTAIN_PHASE) ? FGPIOB_PSOR : FGPIOB_PCOR); \
-writel((1 << 7), (x == RELEASE_PHASE) ? FGPIOA_PSOR : FGPIOA_PCOR); \
-} while(0);
-#else
-#define DEBUG_PHASE(x)
+#if SFX_CHANNELS
+    if (opts->sfx_period) {
+        uint64_t next = now_ns();
+
+        while (!play.stop && (!play.frames || (engine_output_sample(engine) < play.frames))) {
+            next += (uint64_t)opts->sfx_period * NS_PER_SECOND / engine->sample_rate;
+            sleep_until_ns(next);
+            trigger_sfx(engine, &blip_sfx, 0);
+        }
+    }
 #endif
-static int32_t processADSR(struct ltc_voice *voice, int32_t output)
-{
-    int32_t pct;
+    pthread_join(thread, 0);
+    signal(SIGINT, SIG_DFL);
+    sink.close(&sink);
 
-    voice->phase_timer++;
-    switch (voice->adsr_phase) {
-        /* For the ATTACK phase, the level starts at at voice->attack_level
-         * and ends at voice->decay_level, during the course of voice->attack_time.
-         */
-        case PHASE_ATTACK:
-            if (voice->attack_time) {
-                /* Function progress:
-                 *     t = 0             pct = voice->attack_level
-                 *     t = attack_time   pct = voice->decay_level
-                 */
-                /* Determine what percentage we'll adjust the note to */
-                pct = ((int32_t)voice->phase_timer * ((int32_t)voice->decay_level - (int32_t)voice->attack_level) / (int32_t)voice->attack_time) + (int32_t)voice->attack_level;
-if (pct > 100)
-panic("Percentage is > 100");
-//fprintf(stderr, "attack_level: %d  decay_level: %d  phase_timer: %d  attack_time: %d  pct: %d\n",
-//voice->attack_level, voice->decay_level, voice->phase_timer, voice->attack_time, pct);
-
-                if (voice->phase_timer >= voice->attack_time) {
-                    ADSR_PHASE(voice, PHASE_DECAY);
-                }
-                break;
-            }
-            /* Fall through if attack_time is 0 */
-            ADSR_PHASE(voice, PHASE_DECAY);
+    play_stats_print(stderr, &play);
+#if SFX_CHANNELS
+    if (opts->sfx_period)
+        sfx_stats_print(stderr, engine);
+#endif
+    return play.status;
+}
+#endif /* !_WIN32 */
 
-        case PHASE_DECAY:
-            if (voice->decay_time) {
-                /* Determine what percentage we'll adjust the note to */
-                pct = ((int32_t)voice->phase_timer * ((int32_t)voice->sustain_level - (int32_t)voice->decay_level) / (int32_t)voice->decay_time) + voice->decay_level;
-//fprintf(stderr, "decay_level: %d  sustain_level: %d  phase_timer: %d  decay_time: %d  pct: %d\n",
-//voice->decay_level, voice->sustain_level, voice->phase_timer, voice->decay_time, pct);
-                if (voice->phase_timer >= voice->decay_time) {
-                    ADSR_PHASE(voice, PHASE_SUSTAIN);
-                }
-                break;
-            }
-            /* Fall through if decay_time is 0 */
-            ADSR_PHASE(voice, PHASE_SUSTAIN);
+// Samples per timed call in the benchmarks.  Each case runs these until its
+// time is up, after one untimed call to warm up the caches.
+#define BENCH_CHUNK 1024
 
-        case PHASE_SUSTAIN:
-            pct = voice->sustain_level;
-            break;
+// Every channel runs an effect or starts a note on every sample, which is
+// the most work the sequencer can be given.
+static const uint16_t bench_effects_pattern[] = {
+    NGT(1),
+    NE(SET_INSTRUMENT, 0),
+    NAT(10),
+    NE(SET_ATTACK_LEVEL, 100),
+    NDT(10),
+    NE(SET_DECAY_LEVEL, 50),
+    NE(SET_SUSTAIN_LEVEL, 40),
+    NRT(10),
+    NE(SET_MIDDLE_C, 40),
+    NN(0, 0, 0),
+    NE(SET_INSTRUMENT, 3),
+    NE(DELAY_TICKS, 0),
+    NN(7, 0, 0),
+    NE(PATTERN_REPEAT_COUNT, 4),
+    NE(PATTERN_JUMP_ABS, 0),
+};
 
-        case PHASE_RELEASE:
-            if (voice->release_time) {
-                /* Determine what percentage we'll adjust the note to */
-                pct = ((int32_t)voice->release_time - (int32_t)voice->phase_timer) * (int32_t)voice->sustain_level / (int32_t)voice->release_time;
-                if (voice->phase_timer >= voice->release_time) {
-                     ADSR_PHASE(voice, PHASE_OFF);
-                }
-                break;
-            }
-            /* Fall through if release_time is 0 */
-            ADSR_PHASE(voice, PHASE_OFF);
+static const uint16_t *bench_effects_patterns[] = {
+    bench_effects_pattern,
+    bench_effects_pattern,
+    bench_effects_pattern,
+    bench_effects_pattern,
+};
 
-        case PHASE_OFF:
-        default:
-            pct = 0;
-            break;
-    }
+static const struct ltc_song bench_effects_song = {
+    .patterns = bench_effects_patterns,
+    .pattern_count = ARRAY_SIZE(bench_effects_patterns),
+    .channel_count = MAX_CHANNELS,
+};
 
-    /* Scale the note volume to the calcualted percentage */
-    output = output * pct / 100;
-    return output;
+// How a case's oscillators are set up
+enum bench_mode {
+    BENCH_INTERPOLATED,
+    BENCH_NEAREST,
+    BENCH_POLYBLEP,
+    BENCH_MIPMAP,
+    BENCH_NO_MODE,              // for cases that don't play anything
+};
+
+static const char *const bench_mode_names[] = {
+    "interp",
+    "nearest",
+    "polyblep",
+    "mipmap",
+    "-",
+};
+
+// Whether a mode does anything different for an instrument
+static int bench_mode_applies(int mode, const struct ltc_instrument *instrument)
+{
+    if (mode == BENCH_POLYBLEP)
+        return instrument->flags & INSTRUMENT_POLYBLEP;
+    if (mode == BENCH_MIPMAP)
+        return instrument->level_count;
+    return 1;
 }
 
-int32_t get_sample(struct ltc_voice *voice)
+struct bench_case {
+    struct ltc_sound_engine engine;
+    const char *name;
+    const char *instrument;
+    int mode;
+    uint8_t voices;
+    int32_t sink;               // keeps results from being optimised away
+    int16_t block[BENCH_CHUNK];
+    uint8_t pwm[BENCH_CHUNK];
+    int32_t mix[BENCH_CHUNK];
+    struct ltc_resampler resampler;
+    int16_t resampled[BENCH_CHUNK * 4];
+};
+
+typedef void (*bench_fn)(struct bench_case *bench);
+
+static void bench_set_mode(struct bench_case *bench)
 {
-    uint32_t period;
-    int32_t output;
-    int32_t v1, v2, v1_weight, v2_weight;
+    bench->engine.interpolation = (bench->mode != BENCH_NEAREST);
+    bench->engine.polyblep = (bench->mode == BENCH_POLYBLEP);
+    bench->engine.mipmaps = (bench->mode == BENCH_MIPMAP);
+}
 
-    if (!voice->instrument)
-        return 0;
+// Start `voices` voices, spread out in pitch, on one instrument.  The
+// envelope ramps slowly so processADSR() does its full work throughout.
+static void bench_start_voices(struct bench_case *bench, uint8_t instrument)
+{
+    struct ltc_sound_engine *engine = &bench->engine;
+    struct ltc_channel *channel = &engine->channels[0];
+    uint8_t voice_num;
 
-    // calculate the phase accumulator distance
-    // we divide the frequency by the sample rate to give us how much of a cycle occurs
-    // between successive samples... assuming a frequency range of 20Hz-20kHz this would
-    // be on the order of 0.0004 to 0.4, so we multiply it to give us a meaningful range
+    engine_init(engine, bench->voices, VOICE_STEAL_OLDEST);
+    bench_set_mode(bench);
+    channel->instrument = &engine->instruments[instrument];
+    channel->adsr.attack_level = 0;
+    channel->adsr.decay_level = 100;
+    channel->adsr.sustain_level = 50;
+    channel->adsr.attack_time = 1 << 20;
+    channel->adsr.decay_time = 1 << 20;
 
-    period = (voice->frequency * PHASEACC_MAX) / SAMPLE_RATE;
+    // Forgetting the channel's voice makes each note take a new one.
+    for (voice_num = 0; voice_num < bench->voices; voice_num++) {
+        channel->voice = NO_VOICE;
+        note_on(engine, 0, note_lut[(30 + voice_num * 5) % ARRAY_SIZE(note_lut)]);
+    }
+}
 
-    // add this to the phase accumulator
-    voice->phase_accumulator += period;
+static void bench_get_sample(struct bench_case *bench)
+{
+    int frame, voice_num;
 
-    // wrap the phase accumulator around
-    voice->phase_accumulator &= (PHASEACC_MAX - 1);
+    for (frame = 0; frame < BENCH_CHUNK; frame++)
+        for (voice_num = 0; voice_num < bench->voices; voice_num++)
+            bench->sink += get_sample(&bench->engine, voice_num);
+}
 
-    // and now get the sine output values for each of the allowed harmonics
-    // to be elegant (and to improve the sound quality) we should really
-    // interpolate between the current table entry and the next one by an amount
-    // proportional to the position between the two entries, but this is just
-    // an example so we won't bother for now
-    uint32_t position = (voice->phase_accumulator * voice->instrument->length) / PHASEACC_MAX;
+static void bench_process_adsr(struct bench_case *bench)
+{
+    int frame, voice_num;
 
-    // Interpolation happens because there are "gaps" that are between the phase
-    // accumulator and the table.
-    if (INTERPOLATION_ENABLED && (voice->instrument->flags & INSTRUMENT_CAN_INTERPOLATE))
-    {
-        // This is how far off we are.  I.e. the error.
-        int32_t distance = voice->phase_accumulator - ((position * PHASEACC_MAX) / voice->instrument->length);
+    for (frame = 0; frame < BENCH_CHUNK; frame++)
+        for (voice_num = 0; voice_num < bench->voices; voice_num++)
+            bench->sink += processADSR(&bench->engine, voice_num, 100);
+}
 
-        // And this is how many "Gaps" there are total between two entries in the table
-        const int32_t gap = PHASEACC_MAX / voice->instrument->length;
+static void bench_play_routine_step(struct bench_case *bench)
+{
+    int frame;
 
-        v1 = voice->instrument->samples[position];
-        position++;
-        if (position >= voice->instrument->length)
-            position -= voice->instrument->length;
-        v2 = voice->instrument->samples[position];
+    for (frame = 0; frame < BENCH_CHUNK; frame++)
+        play_routine_step(&bench->engine);
+    bench->sink += bench->engine.active_voices;
+}
 
-        v1_weight = gap - distance;
-        v2_weight = gap - v1_weight;
+// What loop() does, minus writing the samples out.
+static void bench_loop(struct bench_case *bench)
+{
+    int frame;
 
-        output = ((v1 * v1_weight) + (v2 * v2_weight)) / gap;
-    }
-    else
-    {
-        output = voice->instrument->samples[position];
-    }
+    render_block(&bench->engine, bench->block, BENCH_CHUNK);
+    bus_to_pwm(&bench->engine, bench->block, bench->pwm, BENCH_CHUNK);
+    for (frame = 0; frame < BENCH_CHUNK; frame++)
+        bench->sink += bench->pwm[frame];
+}
 
-    output = processADSR(voice, output);
+// The mix bus on its own, fed a mix loud enough to keep the soft clipper
+// busy.
+static void bench_bus(struct bench_case *bench)
+{
+    int frame;
 
-    return output;
+    bus_mix(&bench->engine, bench->mix, bench->block, BENCH_CHUNK);
+    bus_to_pwm(&bench->engine, bench->block, bench->pwm, BENCH_CHUNK);
+    for (frame = 0; frame < BENCH_CHUNK; frame++)
+        bench->sink += bench->pwm[frame];
 }
 
-static void note_on(struct ltc_voice *voice, uint32_t freq)
+static void bench_resample(struct bench_case *bench)
 {
-    voice->frequency = freq;
-    voice->phase_accumulator = 0;
-    ADSR_PHASE(voice, PHASE_ATTACK);
+    uint32_t made = resample_block(&bench->resampler, bench->block, BENCH_CHUNK, bench->resampled);
+
+    bench->sink += bench->resampled[made - 1];
 }
 
-static void note_off(struct ltc_voice *voice)
+static void bench_run(struct bench_case *bench, bench_fn fn, double budget)
 {
-    voice->phase_timer = 0;
-    if (voice->adsr_phase != PHASE_OFF)
-        ADSR_PHASE(voice, PHASE_RELEASE);
+    uint64_t frames = 0;
+    double start, elapsed;
+
+    fn(bench);
+    start = now_seconds();
+    do {
+        fn(bench);
+        frames += BENCH_CHUNK;
+        elapsed = now_seconds() - start;
+    } while (elapsed < budget);
+
+    printf("%s %s %s %u %llu %.2f %.2f %.1f %.3f\n", bench->name, bench->instrument,
+           bench_mode_names[bench->mode],
+           bench->voices, (unsigned long long)frames,
+           elapsed * 1e9 / frames, elapsed * 1e9 / frames / bench->voices,
+           frames / elapsed / SAMPLE_RATE, elapsed * SAMPLE_RATE * 100 / frames);
 }
 
-static void play_routine_step(struct ltc_sound_engine *engine) {
-    int voice_num;
-    for (voice_num = 0; voice_num < VOICE_COUNT; voice_num++) {
-        struct ltc_voice *voice = &engine->voices[voice_num];
-        if ((voice->note_duration == 0) && (voice->rest_duration == 0)) {
-            uint16_t op = voice->pattern[voice->pattern_offset++];
-            if ((op & 0xf000) == 0x8000) {
-                uint32_t effect_num = (op >> 8) & 0x7f;
-                if (effect_num > ARRAY_SIZE(effect_lut)) {
-                    panic("effect_num out of range");
-                }
-                effect_lut[effect_num](engine, voice_num, op & 0xff);
-            }
-            else if ((op & 0xf000) == 0x9000) {
-                setGlobalSpeed(engine, voice_num, op & 0xfff);
-            }
-            else if ((op & 0xf000) == 0xa000) {
-                setAttackTime(engine, voice_num, op & 0xfff);
-            }
-            else if ((op & 0xf000) == 0xb000) {
-                setDecayTime(engine, voice_num, op & 0xfff);
-            }
-            else if ((op & 0xf000) == 0xc000) {
-                setReleaseTime(engine, voice_num, op & 0xfff);
-            }
-            else {
-                uint32_t note_duration = (op >> 10) & 0x1f;
-                uint32_t rest_duration = (op >> 5) & 0x1f;
-                uint32_t note_index = ((op >> 0) & 0x1f) - 16;
-                note_index = voice->middle_c + note_index;
+// A song for checking that notes keep to the tempo: 173 samples a tick at
+// SAMPLE_RATE, which is a fraction of a sample at other rates, with effects
+// between the notes.  The loop is 15 ticks long, with notes 0, 4 and 8
+// ticks in.
+#define DRIFT_SPEED 173
+#define DRIFT_LOOP_TICKS 15
+#define DRIFT_MINUTES 10
 
-                if (note_index > ARRAY_SIZE(note_lut))
-                    panic("note_index out of range");
-                note_on(voice, note_lut[note_index]);
+static const uint8_t drift_note_ticks[] = {0, 4, 8};
 
-                voice->note_duration = note_duration * engine->loops_per_tick;
-                voice->rest_duration = rest_duration * engine->loops_per_tick;
-            }
-        }
-        else if (voice->note_duration) {
-            voice->note_duration--;
-            if (!voice->note_duration)
-                note_off(voice);
-        }
-        else if (voice->rest_duration) {
-            voice->rest_duration--;
+static const uint16_t drift_intro_pattern[] = {
+    NGT(DRIFT_SPEED),
+    NE(PATTERN_JUMP_ABS, 1),
+};
+
+static const uint16_t drift_loop_pattern[] = {
+    NE(SET_INSTRUMENT, 0),
+    NN(0, 3, 1),
+    NE(SET_MIDDLE_C, 40),
+    NN(2, 1, 2),
+    NE(DELAY_TICKS, 1),
+    NN(4, 5, 2),
+    NE(PATTERN_JUMP_ABS, 1),
+};
+
+static const uint16_t *drift_patterns[] = {
+    drift_intro_pattern,
+    drift_loop_pattern,
+};
+
+static const struct ltc_song drift_song = {
+    .patterns = drift_patterns,
+    .pattern_count = ARRAY_SIZE(drift_patterns),
+    .channel_count = 1,
+};
+
+// Render DRIFT_MINUTES of drift_song a sample at a time at `rate`, and
+// print how far the notes started from where the tempo puts them, at worst
+// and by the end.
+static void bench_drift(struct bench_case *bench, uint32_t rate)
+{
+    struct ltc_sound_engine *engine = &bench->engine;
+    uint32_t frames = DRIFT_MINUTES * 60 * rate, frame;
+    uint32_t serial = 0, notes = 0, loops = 0;
+    int64_t error = 0, worst = 0;
+    int16_t out;
+
+    engine_init(engine, 1, VOICE_STEAL_OLDEST);
+    engine_set_sample_rate(engine, rate);
+    setSong(engine, &drift_song);
+    for (frame = 0; frame < frames; frame++) {
+        uint64_t ticks;
+
+        render_block(engine, &out, 1);
+        if (engine->voice_serial == serial)
+            continue;
+        serial = engine->voice_serial;
+
+        // Where the tempo puts this note, rounded down like the engine.
+        ticks = (uint64_t)loops * DRIFT_LOOP_TICKS + drift_note_ticks[notes];
+        error = frame - (int64_t)(ticks * DRIFT_SPEED * rate / SAMPLE_RATE);
+        if ((error > worst) || (-error > worst))
+            worst = (error < 0) ? -error : error;
+        if (++notes == ARRAY_SIZE(drift_note_ticks)) {
+            notes = 0;
+            loops++;
         }
     }
+
+    printf("drift %u %u %lld %lld %.3f\n", rate, loops, (long long)worst, (long long)error,
+           error * 1e3 / rate);
 }
 
-#ifdef ARDUINO_APP
+// Time each part of the engine on its own and then all together, spending
+// `budget` seconds on each case.  One line is printed per case; a "frame"
+// is one output sample, which covers every voice.  The last two columns are
+// how many times faster than real time this machine managed, and what
+// share of the time one sample lasts each frame took.
+static int run_benchmarks(double budget)
+{
+    struct bench_case *bench = (struct bench_case *)calloc(1, sizeof(*bench));
+    size_t instrument;
+    int mode;
+    int song;
 
-#include "Arduino.h"
-#include "ChibiOS.h"
-#include "kl02.h"
-#include "memio.h"
+    if (!bench) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
 
-static int pwm0_stable_timer(void)
-{
-    static int loops = 0;
+    printf("# case instrument mode voices frames ns/frame ns/voice realtime budget%%\n");
 
-    loops++;
-    if (loops > PWM_DELAY_LOOPS)
-    {
-        int32_t scaled_sample = next_sample + 129;
-        if (scaled_sample > 255)
-            scaled_sample = 255;
-        if (scaled_sample < 1)
-            scaled_sample = 1;
-        writel(scaled_sample, TPM0_C1V);
-        writel(scaled_sample, TPM0_C0V);
+    // Band-limiting is only timed for the instruments that can use it.
+    for (instrument = 0; instrument < ARRAY_SIZE(instruments); instrument++) {
+        for (mode = BENCH_INTERPOLATED; mode < BENCH_NO_MODE; mode++) {
+            if (!bench_mode_applies(mode, instruments[instrument]))
+                continue;
+            for (bench->voices = 1; bench->voices <= MAX_VOICES; bench->voices++) {
+                bench->name = "get_sample";
+                bench->instrument = instrument_names[instrument];
+                bench->mode = mode;
+                bench_start_voices(bench, instrument);
+                bench_run(bench, bench_get_sample, budget);
+            }
+        }
+    }
 
-        loops = 0;
-        sample_queued = 0;
-        //global_tick_counter++;
+    for (bench->voices = 1; bench->voices <= MAX_VOICES; bench->voices++) {
+        bench->name = "processADSR";
+        bench->instrument = "-";
+        bench->mode = BENCH_NO_MODE;
+        bench_start_voices(bench, 0);
+        bench_run(bench, bench_process_adsr, budget);
     }
 
-    static int other_loops;
-    if (other_loops++ > 12) {
-        global_tick_counter++;
-        other_loops = 0;
+    for (song = 0; song < 2; song++) {
+        bench->name = "play_routine_step";
+        bench->instrument = song ? "effects" : builtin_batch_songs[0].name;
+        bench->mode = BENCH_NO_MODE;
+        bench->voices = MAX_VOICES;
+        engine_init(&bench->engine, bench->voices, VOICE_STEAL_RELEASED_FIRST);
+        setSong(&bench->engine, song ? &bench_effects_song : builtin_batch_songs[0].song);
+        bench_run(bench, bench_play_routine_step, budget);
     }
 
-    /* Reset the timer IRQ, to allow us to fire again next time */
-    writel(TPM0_STATUS_CH1F | TPM0_STATUS_CH0F | TPM0_STATUS_TOF, TPM0_STATUS);
+    // The song's own instruments, then each one forced in turn.
+    for (instrument = 0; instrument <= ARRAY_SIZE(instruments); instrument++) {
+        for (mode = BENCH_INTERPOLATED; mode < BENCH_NO_MODE; mode++) {
+            if (instrument && !bench_mode_applies(mode, instruments[instrument - 1]))
+                continue;
+            for (bench->voices = 1; bench->voices <= MAX_VOICES; bench->voices++) {
+                bench->name = "loop";
+                bench->instrument = instrument ? instrument_names[instrument - 1] : "own";
+                bench->mode = mode;
+                engine_init(&bench->engine, bench->voices, VOICE_STEAL_RELEASED_FIRST);
+                bench_set_mode(bench);
+                bench->engine.instrument_override =
+                    instrument ? &bench->engine.instruments[instrument - 1] : 0;
+                setSong(&bench->engine, &sample_song);
+                bench_run(bench, bench_loop, budget);
+            }
+        }
+    }
+
+    // The mix bus with and without its dither and soft clipping, which
+    // costs the same however many voices are playing.
+    for (mode = 0; mode < 2; mode++) {
+        int frame;
+
+        bench->name = "bus";
+        bench->instrument = mode ? "plain" : "dither";
+        bench->mode = BENCH_NO_MODE;
+        bench->voices = 1;
+        engine_init(&bench->engine, MAX_VOICES, VOICE_STEAL_RELEASED_FIRST);
+        bench->engine.dither = !mode;
+        bench->engine.soft_clip = !mode;
+        for (frame = 0; frame < BENCH_CHUNK; frame++)
+            bench->mix[frame] = (frame * 7 % 401) - 200;
+        bench_run(bench, bench_bus, budget);
+    }
+
+    // The resampler for desktop output, per engine sample.
+    for (mode = 0; mode < 2; mode++) {
+        int frame;
+
+        bench->name = "resample";
+        bench->instrument = mode ? "48000" : "44100";
+        bench->mode = BENCH_NO_MODE;
+        bench->voices = 1;
+        resampler_init(&bench->resampler, SAMPLE_RATE, mode ? 48000 : 44100);
+        for (frame = 0; frame < BENCH_CHUNK; frame++)
+            bench->block[frame] = (frame * 997 % 40001) - 20000;
+        bench_run(bench, bench_resample, budget);
+    }
+
+    // The worst case: every channel running a burst of effects and notes
+    // every few samples.
+    for (bench->voices = 1; bench->voices <= MAX_VOICES; bench->voices++) {
+        bench->name = "loop";
+        bench->instrument = "effects";
+        bench->mode = POLYBLEP_ENABLED ? BENCH_POLYBLEP : BENCH_INTERPOLATED;
+        engine_init(&bench->engine, bench->voices, VOICE_STEAL_RELEASED_FIRST);
+        bench_set_mode(bench);
+        setSong(&bench->engine, &bench_effects_song);
+        bench_run(bench, bench_loop, budget);
+    }
+
+    // Whether long songs keep time at the device's rate and others.
+    printf("# drift rate loops worst-samples end-samples end-ms\n");
+    bench_drift(bench, SAMPLE_RATE);
+    bench_drift(bench, 8000);
+    bench_drift(bench, 44100);
+    bench_drift(bench, 48000);
 
+    free(bench);
     return 0;
 }
 
-static void prepare_pwm()
+static void usage(const char *name)
 {
-    // Write dummy values out, to configure PWM mux
-    pinMode(0, OUTPUT);
-    analogWrite(0, 63);
-    pinMode(1, OUTPUT);
-    analogWrite(1, 63);
+    fprintf(stderr,
+            "Usage: %s [-o FILE] [-f u8|wav] [-t SECONDS|end] [-e RATE] [-r RATE] [-v VOICES]\n"
+            "       %s -b [-j THREADS] [-o DIR] [-f u8|wav] [-t SECONDS|end] [-v VOICES] [FILE...]\n"
+            "       %s -p SINK [-t SECONDS] [-x MS] [-e RATE] [-r RATE]\n"
+            "       %s --bench [-t SECONDS]\n"
+            "       %s --write-song FILE\n"
+            "       %s --write-instrument FILE\n"
+            "With no -o, plays forever to stdout, for piping into `play`; only\n"
+            "-s, -m and -I apply then.\n"
+            "  -b          batch: render every song with every instrument and\n"
+            "              print a hash of each, writing them to DIR if given.  The\n"
+            "              songs are the containers given with -s or as FILEs, or\n"
+            "              else the built-in song\n"
+            "  -j THREADS  threads to render the batch on (default: all CPUs)\n"
+            "  --bench     time the engine, spending SECONDS (default 0.1) on each\n"
+            "              case, and print one line per case\n"
+            "  -o FILE     render to FILE (\"-\" for stdout) as fast as possible\n"
+            "  -s FILE     play the song container FILE instead of the built-in\n"
+            "              song, streaming it from disk where that's built in\n"
+            "  -p SINK     play in real time from a render thread to SINK: alsa,\n"
+            "              alsa:DEVICE, null to keep time without a sound card, or a\n"
+            "              file for raw 16-bit samples; prints the thread's timing.\n"
+            "              Plays until interrupted unless -t is given\n"
+            "  -m          with -s, map FILE into memory and play it in place\n"
+            "  -x MS       trigger a sound effect every MS milliseconds, and print\n"
+            "              how long each took to start\n"
+            "  -d PERCENT  with -x, turn the song down to PERCENT while effects play\n"
+            "  -c SECONDS  crossfade to the song from the top after SECONDS\n"
+            "  -g PERCENT  master volume (default 100)\n"
+            "  -n          no dither or soft clipping on the mix bus\n"
+            "  --write-song FILE  write the built-in song to FILE as a container\n"
+            "  -I FILE     play every note on the instrument container FILE\n"
+            "  --write-instrument FILE  write the sine instrument to FILE as a\n"
+            "              container\n"
+            "  -f FORMAT   u8 for raw unsigned 8-bit (default), wav for 16-bit WAV\n"
+            "  -t SECONDS  length to render, or \"end\" to stop when the song does\n"
+            "              (default), giving up after %d seconds\n"
+            "  -e RATE     rate the engine runs at, %d-%d (default %d)\n"
+            "  -r RATE     output rate, resampled up from the engine's, up to %d\n"
+            "              (default: the engine's)\n"
+            "  -v VOICES   size of the voice pool, 1-%d (default %d)\n",
+            name, name, name, name, name, name, OFFLINE_MAX_SECONDS, ENGINE_MIN_RATE, ENGINE_MAX_RATE,
+            SAMPLE_RATE, RESAMPLE_MAX_RATE, MAX_VOICES, MAX_VOICES);
+}
 
-    // Disable TPM0, allowing us to configure it
-    writel(0, TPM0_SC);
+// What main() does, going by the options given, and which of those modes
+// take each of the other options, so that an option a mode would ignore is
+// refused instead.
+#define MODE_STREAM (1 << 0)    // setup() and loop(), forever, to stdout
+#define MODE_RENDER (1 << 1)    // -o
+#define MODE_PLAY (1 << 2)      // -p
+#define MODE_BATCH (1 << 3)     // -b
+#define MODE_BENCH (1 << 4)     // --bench
+#define MODE_ENGINE (MODE_RENDER | MODE_PLAY | MODE_BATCH)
 
-    // Also disable both channels, which are running from the
-    // calls to analogWrite() above
-    writel(0, TPM0_C0SC);
-    writel(0, TPM0_C1SC);
+static const struct {
+    const char *name;
+    uint8_t modes;
+} option_modes[] = {
+    { "-o", MODE_RENDER | MODE_BATCH },
+    { "-p", MODE_PLAY },
+    { "-s", MODE_STREAM | MODE_RENDER | MODE_PLAY | MODE_BATCH },
+    { "-m", MODE_STREAM | MODE_RENDER | MODE_PLAY },
+    { "-I", MODE_STREAM | MODE_RENDER | MODE_PLAY },
+    { "-x", MODE_ENGINE },
+    { "-d", MODE_ENGINE },
+    { "-c", MODE_ENGINE },
+    { "-g", MODE_ENGINE },
+    { "-n", MODE_ENGINE },
+    { "-e", MODE_ENGINE },
+    { "-r", MODE_ENGINE },
+    { "-v", MODE_ENGINE },
+    { "-f", MODE_RENDER | MODE_BATCH },
+    { "-t", MODE_ENGINE | MODE_BENCH },
+    { "-j", MODE_BATCH },
+};
 
-    // Configure the TPM to use the MCGFLLCLK (~32 MHz?)
-    writel(readl(SIM_SOPT2) | (1 << 24), SIM_SOPT2);
+static const char *mode_name(int mode)
+{
+    switch (mode) {
+    case MODE_RENDER:
+        return "-o";
+    case MODE_PLAY:
+        return "-p";
+    case MODE_BATCH:
+        return "-b";
+    case MODE_BENCH:
+        return "--bench";
+    }
+    return "playing to stdout without -o";
+}
 
-    // We've picked pin 0, which is on TPM0_CH1
-    writel(255, TPM0_MOD);
-    writel(0, TPM0_CNT);
+int main(int argc, char **argv) {
+    static struct render_scratch scratch;
+    static struct song_file song_file;
+    struct render_options opts;
+    struct render_result result;
+    const char *song_path = 0, *sink = 0, *instrument_path = 0;
+    const char **song_paths;
+    int song_count = 0;
+    double seconds = 0, sfx_ms = 0, crossfade_seconds = 0;
+    int batch = 0, bench = 0, load = 0, threads = 1;
+    uint32_t given = 0;
+    int arg, mode, i;
 
-    writel(TPM0_C0SC_MSB | TPM0_C0SC_ELSB, TPM0_C0SC);
-    writel(TPM0_C1SC_MSB | TPM0_C1SC_ELSA, TPM0_C1SC);
+    memset(&opts, 0, sizeof(opts));
+    opts.format = FORMAT_U8;
+    opts.engine_rate = SAMPLE_RATE;
+    opts.voices = MAX_VOICES;
+    opts.song = &sample_song;
+    opts.duck = -1;
+    opts.volume = 100;
+    opts.instrument = -1;
+#ifndef _WIN32
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
 
-    writel(100, TPM0_C1V);
-    writel(100, TPM0_C0V);
-    writel(TPM0_CONF_TRGSEL(8), TPM0_CONF);
-    writel(TPM0_SC_TOF | TPM0_SC_TOIE | TPM0_SC_CMOD(1) | TPM0_SC_PS(0), TPM0_SC); // Enable TPM0
+    // Every -s, and every argument that isn't an option, is a song.  Only
+    // -b takes more than one.
+    song_paths = (const char **)calloc(argc, sizeof(*song_paths));
+    if (!song_paths) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
 
-    /* Enable the IRQ in the system-wide interrupt table */
-    attachFastInterrupt(PWM0_IRQ, pwm0_stable_timer);
-}
-#endif
+    for (arg = 1; arg < argc; arg++) {
+        const char *value = (arg + 1 < argc) ? argv[arg + 1] : 0;
+        const char *name = (argv[arg][0] == '-') ? argv[arg] : "-s";
 
-void setup(void)
-{
-    setSong(&engine, &sample_song);
-#ifdef ARDUINO_APP
-    prepare_pwm();
-    enableInterrupt(PWM0_IRQ);
-    pinMode(2, OUTPUT);
-    pinMode(3, OUTPUT);
-    pinMode(4, OUTPUT);
-    pinMode(5, OUTPUT);
-#endif
-}
+        for (i = 0; i < (int)ARRAY_SIZE(option_modes); i++)
+            if (!strcmp(name, option_modes[i].name))
+                given |= 1UL << i;
+        if (!strcmp(argv[arg], "-h") || !strcmp(argv[arg], "--help")) {
+            usage(argv[0]);
+            return 0;
+        }
+        if (!strcmp(argv[arg], "-b")) {
+            batch = 1;
+            continue;
+        }
+        if (!strcmp(argv[arg], "--bench")) {
+            bench = 1;
+            continue;
+        }
+        if (!strcmp(argv[arg], "-m")) {
+            load = 1;
+            continue;
+        }
+        if (!strcmp(argv[arg], "-n")) {
+            opts.plain_bus = 1;
+            continue;
+        }
+        if (argv[arg][0] != '-') {
+            song_paths[song_count++] = argv[arg];
+            continue;
+        }
+        if (!value) {
+            usage(argv[0]);
+            return 1;
+        }
+        arg++;
 
-void loop(void)
-{
-    uint32_t voice_num;
-    // If a sample is still in the buffer, don't do anything.
-    if (sample_queued)
-        return;
+        if (!strcmp(argv[arg - 1], "-o"))
+            opts.path = value;
+        else if (!strcmp(argv[arg - 1], "-s"))
+            song_paths[song_count++] = value;
+        else if (!strcmp(argv[arg - 1], "-p"))
+            sink = value;
+#if SFX_CHANNELS
+        else if (!strcmp(argv[arg - 1], "-x") && (atof(value) > 0))
+            sfx_ms = atof(value);
+#endif
+        else if (!strcmp(argv[arg - 1], "-d") && (atoi(value) >= 0) && (atoi(value) <= 100))
+            opts.duck = atoi(value);
+        else if (!strcmp(argv[arg - 1], "-g") && (atoi(value) >= 0) && (atoi(value) <= 255))
+            opts.volume = atoi(value);
+        else if (!strcmp(argv[arg - 1], "-c") && (atof(value) > 0))
+            crossfade_seconds = atof(value);
+        else if (!strcmp(argv[arg - 1], "-I"))
+            instrument_path = value;
+        else if (!strcmp(argv[arg - 1], "--write-song"))
+            return song_file_write(value, &sample_song);
+        else if (!strcmp(argv[arg - 1], "--write-instrument"))
+            return instrument_file_write(value, &sine_instrument);
+        else if (!strcmp(argv[arg - 1], "-f") && !strcmp(value, "u8"))
+            opts.format = FORMAT_U8;
+        else if (!strcmp(argv[arg - 1], "-f") && !strcmp(value, "wav"))
+            opts.format = FORMAT_WAV16;
+        else if (!strcmp(argv[arg - 1], "-t") && !strcmp(value, "end"))
+            seconds = 0;
+        else if (!strcmp(argv[arg - 1], "-t") && (atof(value) > 0))
+            seconds = atof(value);
+        else if (!strcmp(argv[arg - 1], "-r") && (atoi(value) > 0))
+            opts.rate = atoi(value);
+        else if (!strcmp(argv[arg - 1], "-e") && (atoi(value) >= ENGINE_MIN_RATE) &&
+                 (atoi(value) <= ENGINE_MAX_RATE))
+            opts.engine_rate = atoi(value);
+        else if (!strcmp(argv[arg - 1], "-v") && (atoi(value) >= 1) && (atoi(value) <= MAX_VOICES))
+            opts.voices = atoi(value);
+        else if (!strcmp(argv[arg - 1], "-j") && (atoi(value) >= 1))
+            threads = atoi(value);
+        else {
+            fprintf(stderr, "%s: bad option %s %s\n", argv[0], argv[arg - 1], value);
+            usage(argv[0]);
+            return 1;
+        }
+    }
 
-    play_routine_step(&engine);
+    if (bench)
+        mode = MODE_BENCH;
+    else if (batch)
+        mode = MODE_BATCH;
+    else if (sink)
+        mode = MODE_PLAY;
+    else if (opts.path)
+        mode = MODE_RENDER;
+    else
+        mode = MODE_STREAM;
+    for (i = 0; i < (int)ARRAY_SIZE(option_modes); i++) {
+        if ((given & (1UL << i)) && !(option_modes[i].modes & mode)) {
+            fprintf(stderr, "%s: %s doesn't apply to %s\n", argv[0], option_modes[i].name,
+                    mode_name(mode));
+            return 1;
+        }
+    }
+    if ((song_count > 1) && (mode != MODE_BATCH)) {
+        fprintf(stderr, "%s: only -b takes more than one song\n", argv[0]);
+        return 1;
+    }
+    song_path = song_paths[0];
+    if (load && !song_path) {
+        fprintf(stderr, "%s: -m needs -s\n", argv[0]);
+        return 1;
+    }
 
-    next_sample = 0;
-    for (voice_num = 0; voice_num < VOICE_COUNT; voice_num++)
-        next_sample += get_sample(&engine.voices[voice_num]);
-    sample_queued = 1;
+    if (!opts.rate)
+        opts.rate = opts.engine_rate;
+    if ((opts.rate < opts.engine_rate) || (opts.rate > RESAMPLE_MAX_RATE)) {
+        fprintf(stderr, "%s: the output rate must be from the engine's %u Hz up to %d Hz\n",
+                argv[0], opts.engine_rate, RESAMPLE_MAX_RATE);
+        return 1;
+    }
+    opts.frames = seconds * opts.engine_rate;
+    opts.sfx_period = sfx_ms * opts.engine_rate / 1000;
+    opts.crossfade_at = crossfade_seconds * opts.engine_rate;
 
-#ifdef DESKTOP
-    {
-#ifdef WRITE_TO_FILE
-        static FILE *outfile;
-        if (!outfile)
-            outfile = fopen("song.raw", "wb");
-#endif
-        int32_t scaled_sample = next_sample + 129;
-        if (scaled_sample > 255)
-            scaled_sample = 255;
-        if (scaled_sample < 1)
-            scaled_sample = 1;
-#ifdef WRITE_TO_FILE
-        fputc(scaled_sample, outfile);
-        if (global_tick_counter >= 524288) {
-            fflush(outfile);
-            exit(0);
+    if (bench)
+        return run_benchmarks(seconds ? seconds : 0.1);
+    if (batch)
+        return render_batch_files(&opts, song_paths, song_count, opts.path, threads);
+    if (song_path) {
+        if (song_file_open(&song_file, song_path, load))
+            return 1;
+        opts.song = &song_file.song;
+    }
+    if (instrument_path) {
+        opts.instrument_container = instrument_file_read(instrument_path, &opts.instrument_size);
+        if (!opts.instrument_container) {
+            song_file_close(&song_file);
+            return 1;
         }
+        opts.instrument = ARRAY_SIZE(instruments);
+    }
+    if (sink) {
+        int status;
+
+#ifndef _WIN32
+        status = play_song(&opts, sink, &scratch.engine);
 #else
-        fputc(scaled_sample, stdout);
-        fflush(stdout);
+        fprintf(stderr, "%s: -p needs POSIX threads\n", argv[0]);
+        status = 1;
 #endif
-        sample_queued = 0;
+        song_file_close(&song_file);
+        free((void *)opts.instrument_container);
+        return status;
     }
+    if (opts.path) {
+        render_song(&opts, &scratch, &result);
+#ifdef CYCLE_STATS
+        cycle_profile_print(stderr, &scratch.engine);
 #endif
-}
+#if SFX_CHANNELS
+        if (opts.sfx_period && !result.status)
+            sfx_stats_print(stderr, &scratch.engine);
+#endif
+#if SONG_STREAMING
+        if (song_streamed(opts.song) && !result.status)
+            fprintf(stderr, "streamed: %u reads ahead, %u misses\n",
+                    scratch.engine.cache_fills, scratch.engine.cache_misses);
+#endif
+        song_file_close(&song_file);
+        free((void *)opts.instrument_container);
+        return result.status;
+    }
 
-#ifdef DESKTOP
-int main(int argc, char **argv) {
     setup();
-    while (1) {
-        loop();
-        global_tick_counter++;
+    if (opts.instrument_container) {
+        if (engine_load_instrument(&engine, opts.instrument, opts.instrument_container,
+                                   opts.instrument_size))
+            panic(engine.instrument_error);
+        engine.instrument_override = &engine.instruments[opts.instrument];
     }
+    if (song_path && setSong(&engine, opts.song))
+        panic(engine.song_error.message);
+    while (1)
+        loop();
     return 0;
 }
 #endif
@@ -4,15 +4,33 @@
 /* Auto-generated file, do not edit */
 /* File generated by gen-tables.py */
 
+/* A band-limited version of an instrument's table, for higher notes */
+struct ltc_wave_level {
+    const int8_t *samples;
+    const uint16_t length;
+    /* The highest harmonic in the table */
+    const uint16_t harmonics;
+};
+
 struct ltc_instrument {
     const int8_t *samples;
     const uint16_t length;
     const uint16_t flags;
+    /* Band-limited levels, with the most harmonics first, if any */
+    const struct ltc_wave_level *levels;
+    const uint8_t level_count;
+    /* For noise: the LFSR's Galois taps, and how far it's clocked above the note */
+    const uint16_t noise_taps;
+    const uint8_t noise_shift;
 };
 
 /* Flags */
 /* Indicates that interpolation on an instrument improves sound */
 #define INSTRUMENT_CAN_INTERPOLATE (1 << 0)
+/* Indicates that the waveform has hard edges, which may be band-limited */
+#define INSTRUMENT_POLYBLEP (1 << 1)
+/* Indicates that the table is indexed by an LFSR rather than the phase */
+#define INSTRUMENT_NOISE (1 << 2)
 
 static const int8_t sine_table_samples[] = {
     0, 6, 12, 18, 24, 30, 36, 42, 
@@ -39,6 +57,43 @@ static const struct ltc_instrument sine_instrument = {
     .flags = INSTRUMENT_CAN_INTERPOLATE,
 };
 
+#define SAWTOOTH_LEVEL_COUNT 5
+static const int8_t sawtooth_level0_samples[] = {
+    0, 98, 127, 104, 89, 97, 100, 87, 
+    80, 84, 82, 73, 68, 70, 67, 58, 
+    55, 55, 52, 44, 41, 41, 37, 30, 
+    28, 27, 22, 16, 14, 13, 7, 1, 
+    0, -1, -7, -13, -14, -16, -22, -27, 
+    -28, -30, -37, -41, -41, -44, -52, -55, 
+    -55, -58, -67, -70, -68, -73, -82, -84, 
+    -80, -87, -100, -97, -89, -104, -127, -98, 
+};
+static const int8_t sawtooth_level1_samples[] = {
+    0, 103, 127, 96, 79, 87, 83, 64, 
+    56, 57, 48, 33, 28, 27, 16, 3, 
+    0, -3, -16, -27, -28, -33, -48, -57, 
+    -56, -64, -83, -87, -79, -96, -127, -103, 
+};
+static const int8_t sawtooth_level2_samples[] = {
+    0, 114, 127, 79, 59, 61, 39, 8, 
+    0, -8, -39, -61, -59, -79, -127, -114, 
+};
+static const int8_t sawtooth_level3_samples[] = {
+    0, 73, 120, 127, 99, 57, 21, 3, 
+    0, -3, -21, -57, -99, -127, -120, -73, 
+};
+static const int8_t sawtooth_level4_samples[] = {
+    0, 49, 90, 117, 127, 117, 90, 49, 
+    0, -49, -90, -117, -127, -117, -90, -49, 
+};
+static const struct ltc_wave_level sawtooth_levels[] = {
+    { sawtooth_level0_samples, sizeof(sawtooth_level0_samples), 16 },
+    { sawtooth_level1_samples, sizeof(sawtooth_level1_samples), 8 },
+    { sawtooth_level2_samples, sizeof(sawtooth_level2_samples), 4 },
+    { sawtooth_level3_samples, sizeof(sawtooth_level3_samples), 2 },
+    { sawtooth_level4_samples, sizeof(sawtooth_level4_samples), 1 },
+};
+
 static const int8_t sawtooth_table_samples[] = {
     127, 122, 118, 114, 110, 106, 102, 98, 
     94, 90, 86, 82, 78, 74, 70, 66, 
@@ -53,7 +108,41 @@ static const int8_t sawtooth_table_samples[] = {
 static const struct ltc_instrument sawtooth_instrument = {
     .samples = sawtooth_table_samples,
     .length = SAWTOOTH_TABLE_SIZE,
-    .flags = 0,
+    .flags = INSTRUMENT_POLYBLEP,
+    .levels = sawtooth_levels,
+    .level_count = SAWTOOTH_LEVEL_COUNT,
+};
+
+#define TRIANGLE_LEVEL_COUNT 4
+static const int8_t triangle_level0_samples[] = {
+    127, 123, 114, 105, 98, 90, 81, 73, 
+    65, 57, 49, 40, 33, 25, 16, 8, 
+    0, -8, -16, -25, -33, -40, -49, -57, 
+    -65, -73, -81, -90, -98, -105, -114, -123, 
+    -127, -123, -114, -105, -98, -90, -81, -73, 
+    -65, -57, -49, -40, -33, -25, -16, -8, 
+    0, 8, 16, 25, 33, 40, 49, 57, 
+    65, 73, 81, 90, 98, 105, 114, 123, 
+};
+static const int8_t triangle_level1_samples[] = {
+    127, 119, 101, 82, 67, 51, 34, 16, 
+    0, -16, -34, -51, -67, -82, -101, -119, 
+    -127, -119, -101, -82, -67, -51, -34, -16, 
+    0, 16, 34, 51, 67, 82, 101, 119, 
+};
+static const int8_t triangle_level2_samples[] = {
+    127, 110, 72, 32, 0, -32, -72, -110, 
+    -127, -110, -72, -32, 0, 32, 72, 110, 
+};
+static const int8_t triangle_level3_samples[] = {
+    127, 117, 90, 49, 0, -49, -90, -117, 
+    -127, -117, -90, -49, 0, 49, 90, 117, 
+};
+static const struct ltc_wave_level triangle_levels[] = {
+    { triangle_level0_samples, sizeof(triangle_level0_samples), 15 },
+    { triangle_level1_samples, sizeof(triangle_level1_samples), 7 },
+    { triangle_level2_samples, sizeof(triangle_level2_samples), 3 },
+    { triangle_level3_samples, sizeof(triangle_level3_samples), 1 },
 };
 
 static const int8_t triangle_table_samples[] = {
@@ -65,6 +154,40 @@ static const struct ltc_instrument triangle_instrument = {
     .samples = triangle_table_samples,
     .length = TRIANGLE_TABLE_SIZE,
     .flags = INSTRUMENT_CAN_INTERPOLATE,
+    .levels = triangle_levels,
+    .level_count = TRIANGLE_LEVEL_COUNT,
+};
+
+#define SQUARE_LEVEL_COUNT 4
+static const int8_t square_level0_samples[] = {
+    0, -94, -127, -110, -97, -107, -115, -108, 
+    -102, -107, -113, -108, -103, -108, -112, -108, 
+    -103, -108, -112, -108, -103, -108, -113, -107, 
+    -102, -108, -115, -107, -97, -110, -127, -94, 
+    0, 94, 127, 110, 97, 107, 115, 108, 
+    102, 107, 113, 108, 103, 108, 112, 108, 
+    103, 108, 112, 108, 103, 108, 113, 107, 
+    102, 108, 115, 107, 97, 110, 127, 94, 
+};
+static const int8_t square_level1_samples[] = {
+    0, -94, -127, -110, -96, -106, -116, -107, 
+    -99, -107, -116, -106, -96, -110, -127, -94, 
+    0, 94, 127, 110, 96, 106, 116, 107, 
+    99, 107, 116, 106, 96, 110, 127, 94, 
+};
+static const int8_t square_level2_samples[] = {
+    0, -93, -127, -107, -90, -107, -127, -93, 
+    0, 93, 127, 107, 90, 107, 127, 93, 
+};
+static const int8_t square_level3_samples[] = {
+    0, -49, -90, -117, -127, -117, -90, -49, 
+    0, 49, 90, 117, 127, 117, 90, 49, 
+};
+static const struct ltc_wave_level square_levels[] = {
+    { square_level0_samples, sizeof(square_level0_samples), 15 },
+    { square_level1_samples, sizeof(square_level1_samples), 7 },
+    { square_level2_samples, sizeof(square_level2_samples), 3 },
+    { square_level3_samples, sizeof(square_level3_samples), 1 },
 };
 
 static const int8_t square_table_samples[] = {
@@ -75,7 +198,101 @@ static const int8_t square_table_samples[] = {
 static const struct ltc_instrument square_instrument = {
     .samples = square_table_samples,
     .length = SQUARE_TABLE_SIZE,
-    .flags = 0,
+    .flags = INSTRUMENT_POLYBLEP,
+    .levels = square_levels,
+    .level_count = SQUARE_LEVEL_COUNT,
+};
+
+static const int8_t noise_table_samples[] = {
+    127, -127,
+};
+#define NOISE_TABLE_SIZE (sizeof(noise_table_samples))
+static const struct ltc_instrument noise_instrument = {
+    .samples = noise_table_samples,
+    .length = NOISE_TABLE_SIZE,
+    .flags = INSTRUMENT_NOISE,
+    .noise_taps = 0xb400,
+    .noise_shift = 4,
+};
+
+static const struct ltc_instrument metallic_instrument = {
+    .samples = noise_table_samples,
+    .length = NOISE_TABLE_SIZE,
+    .flags = INSTRUMENT_NOISE,
+    .noise_taps = 0x60,
+    .noise_shift = 5,
+};
+
+/* Polyphase resampler, cut off at 0.9 of the input's Nyquist */
+#define RESAMPLE_TAPS 16
+#define RESAMPLE_PHASE_BITS 6
+#define RESAMPLE_PHASES (1 << RESAMPLE_PHASE_BITS)
+static const int16_t resample_taps[RESAMPLE_PHASES + 1][RESAMPLE_TAPS] = {
+    { 48, -192, 511, -1046, 1755, -2495, 3063, 29480, 3063, -2495, 1755, -1046, 511, -192, 48, 0 },
+    { 48, -192, 504, -1019, 1680, -2316, 2599, 29474, 3537, -2674, 1829, -1072, 518, -192, 48, -4 },
+    { 49, -191, 496, -990, 1603, -2135, 2145, 29445, 4021, -2852, 1900, -1097, 523, -192, 47, -4 },
+    { 49, -189, 487, -960, 1524, -1954, 1702, 29396, 4513, -3027, 1968, -1119, 527, -191, 46, -4 },
+    { 49, -187, 478, -928, 1443, -1773, 1270, 29325, 5015, -3200, 2034, -1139, 530, -190, 45, -4 },
+    { 49, -185, 467, -895, 1361, -1592, 849, 29238, 5524, -3371, 2097, -1158, 532, -188, 44, -4 },
+    { 48, -183, 456, -861, 1278, -1412, 440, 29129, 6042, -3538, 2157, -1174, 533, -186, 43, -4 },
+    { 48, -180, 444, -826, 1195, -1234, 43, 29002, 6566, -3702, 2214, -1189, 533, -184, 41, -3 },
+    { 47, -177, 432, -790, 1110, -1056, -341, 28853, 7097, -3862, 2268, -1201, 532, -180, 39, -3 },
+    { 47, -173, 419, -753, 1025, -880, -713, 28686, 7635, -4018, 2317, -1211, 529, -177, 38, -3 },
+    { 46, -170, 405, -716, 940, -706, -1073, 28502, 8178, -4169, 2363, -1219, 526, -173, 36, -2 },
+    { 45, -166, 391, -677, 854, -534, -1419, 28298, 8726, -4315, 2405, -1224, 521, -168, 33, -2 },
+    { 44, -162, 376, -639, 768, -365, -1752, 28077, 9278, -4455, 2443, -1226, 514, -163, 31, -1 },
+    { 43, -157, 361, -599, 683, -199, -2071, 27835, 9835, -4590, 2477, -1227, 507, -157, 28, -1 },
+    { 42, -152, 346, -560, 598, -36, -2378, 27575, 10395, -4718, 2506, -1224, 498, -150, 26, 0 },
+    { 41, -148, 330, -520, 513, 124, -2670, 27300, 10958, -4840, 2530, -1219, 488, -143, 23, 1 },
+    { 40, -143, 314, -480, 429, 280, -2949, 27007, 11523, -4954, 2550, -1211, 477, -136, 20, 1 },
+    { 39, -137, 298, -440, 346, 432, -3213, 26697, 12089, -5061, 2565, -1201, 464, -128, 16, 2 },
+    { 38, -132, 281, -400, 264, 581, -3464, 26369, 12657, -5160, 2575, -1188, 450, -119, 13, 3 },
+    { 36, -127, 265, -360, 183, 725, -3701, 26028, 13224, -5251, 2580, -1172, 435, -110, 9, 4 },
+    { 35, -121, 248, -320, 104, 864, -3924, 25671, 13792, -5333, 2579, -1153, 418, -101, 5, 4 },
+    { 34, -115, 231, -280, 26, 999, -4133, 25298, 14358, -5407, 2573, -1131, 400, -91, 1, 5 },
+    { 32, -110, 214, -241, -51, 1129, -4328, 24912, 14923, -5471, 2562, -1107, 381, -80, -3, 6 },
+    { 31, -104, 198, -202, -126, 1254, -4509, 24509, 15486, -5525, 2545, -1080, 360, -69, -7, 7 },
+    { 30, -98, 181, -163, -199, 1374, -4676, 24092, 16045, -5569, 2523, -1049, 338, -57, -12, 8 },
+    { 28, -92, 164, -125, -270, 1488, -4829, 23662, 16602, -5603, 2495, -1016, 315, -45, -16, 10 },
+    { 27, -87, 147, -88, -339, 1597, -4968, 23223, 17154, -5626, 2461, -980, 290, -33, -21, 11 },
+    { 25, -81, 131, -52, -406, 1701, -5094, 22771, 17701, -5638, 2421, -942, 265, -20, -26, 12 },
+    { 24, -75, 115, -16, -471, 1799, -5206, 22305, 18243, -5639, 2375, -900, 238, -6, -31, 13 },
+    { 22, -69, 98, 19, -534, 1891, -5305, 21832, 18778, -5628, 2324, -856, 210, 8, -36, 14 },
+    { 21, -64, 83, 54, -594, 1978, -5391, 21344, 19307, -5605, 2266, -809, 181, 22, -41, 16 },
+    { 20, -58, 67, 87, -651, 2059, -5463, 20847, 19829, -5570, 2203, -759, 150, 37, -47, 17 },
+    { 18, -52, 52, 119, -706, 2134, -5523, 20341, 20343, -5523, 2134, -706, 119, 52, -52, 18 },
+    { 17, -47, 37, 150, -759, 2203, -5570, 19829, 20847, -5463, 2059, -651, 87, 67, -58, 20 },
+    { 16, -41, 22, 181, -809, 2266, -5605, 19307, 21344, -5391, 1978, -594, 54, 83, -64, 21 },
+    { 14, -36, 8, 210, -856, 2324, -5628, 18778, 21832, -5305, 1891, -534, 19, 98, -69, 22 },
+    { 13, -31, -6, 238, -900, 2375, -5639, 18243, 22305, -5206, 1799, -471, -16, 115, -75, 24 },
+    { 12, -26, -20, 265, -942, 2421, -5638, 17701, 22771, -5094, 1701, -406, -52, 131, -81, 25 },
+    { 11, -21, -33, 290, -980, 2461, -5626, 17154, 23223, -4968, 1597, -339, -88, 147, -87, 27 },
+    { 10, -16, -45, 315, -1016, 2495, -5603, 16602, 23662, -4829, 1488, -270, -125, 164, -92, 28 },
+    { 8, -12, -57, 338, -1049, 2523, -5569, 16045, 24092, -4676, 1374, -199, -163, 181, -98, 30 },
+    { 7, -7, -69, 360, -1080, 2545, -5525, 15486, 24509, -4509, 1254, -126, -202, 198, -104, 31 },
+    { 6, -3, -80, 381, -1107, 2562, -5471, 14923, 24912, -4328, 1129, -51, -241, 214, -110, 32 },
+    { 5, 1, -91, 400, -1131, 2573, -5407, 14358, 25298, -4133, 999, 26, -280, 231, -115, 34 },
+    { 4, 5, -101, 418, -1153, 2579, -5333, 13792, 25671, -3924, 864, 104, -320, 248, -121, 35 },
+    { 4, 9, -110, 435, -1172, 2580, -5251, 13224, 26028, -3701, 725, 183, -360, 265, -127, 36 },
+    { 3, 13, -119, 450, -1188, 2575, -5160, 12657, 26369, -3464, 581, 264, -400, 281, -132, 38 },
+    { 2, 16, -128, 464, -1201, 2565, -5061, 12089, 26697, -3213, 432, 346, -440, 298, -137, 39 },
+    { 1, 20, -136, 477, -1211, 2550, -4954, 11523, 27007, -2949, 280, 429, -480, 314, -143, 40 },
+    { 1, 23, -143, 488, -1219, 2530, -4840, 10958, 27300, -2670, 124, 513, -520, 330, -148, 41 },
+    { 0, 26, -150, 498, -1224, 2506, -4718, 10395, 27575, -2378, -36, 598, -560, 346, -152, 42 },
+    { -1, 28, -157, 507, -1227, 2477, -4590, 9835, 27835, -2071, -199, 683, -599, 361, -157, 43 },
+    { -1, 31, -163, 514, -1226, 2443, -4455, 9278, 28077, -1752, -365, 768, -639, 376, -162, 44 },
+    { -2, 33, -168, 521, -1224, 2405, -4315, 8726, 28298, -1419, -534, 854, -677, 391, -166, 45 },
+    { -2, 36, -173, 526, -1219, 2363, -4169, 8178, 28502, -1073, -706, 940, -716, 405, -170, 46 },
+    { -3, 38, -177, 529, -1211, 2317, -4018, 7635, 28686, -713, -880, 1025, -753, 419, -173, 47 },
+    { -3, 39, -180, 532, -1201, 2268, -3862, 7097, 28853, -341, -1056, 1110, -790, 432, -177, 47 },
+    { -3, 41, -184, 533, -1189, 2214, -3702, 6566, 29002, 43, -1234, 1195, -826, 444, -180, 48 },
+    { -4, 43, -186, 533, -1174, 2157, -3538, 6042, 29129, 440, -1412, 1278, -861, 456, -183, 48 },
+    { -4, 44, -188, 532, -1158, 2097, -3371, 5524, 29238, 849, -1592, 1361, -895, 467, -185, 49 },
+    { -4, 45, -190, 530, -1139, 2034, -3200, 5015, 29325, 1270, -1773, 1443, -928, 478, -187, 49 },
+    { -4, 46, -191, 527, -1119, 1968, -3027, 4513, 29396, 1702, -1954, 1524, -960, 487, -189, 49 },
+    { -4, 47, -192, 523, -1097, 1900, -2852, 4021, 29445, 2145, -2135, 1603, -990, 496, -191, 49 },
+    { -4, 48, -192, 518, -1072, 1829, -2674, 3537, 29474, 2599, -2316, 1680, -1019, 504, -192, 48 },
+    { 0, 48, -192, 511, -1046, 1755, -2495, 3063, 29480, 3063, -2495, 1755, -1046, 511, -192, 48 },
 };
 
 #endif /* WAVE_LUT_H */